@@ -14,7 +14,10 @@
  * Highlights:
  *
  *   - Portable, self-contained, tiny implementation in readable C++. 
- *     (Header-only, no ifdefs or CPU dependencies or other stupid tricks.)
+ *     (Header-only, no CPU dependencies or other stupid tricks. The one ifdef is
+ *     LZ77_METRICS, which is off unless defined as 1. crc32c_hash_t computes the
+ *     same function as the SSE4.2 'crc32' instruction, but with a lookup table,
+ *     so there is no hardware path.)
  *   - Fast decompression.
  *   - Pretty good compression quality.
  *   - Simple 'one-button' API for realistic use-cases.
@@ -88,13 +91,25 @@
 
  
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <math.h>
 #include <string.h>
 #include <stdint.h>
 
+// Define as 1 to record latency histograms; see metrics_snapshot().
+#ifndef LZ77_METRICS
+#define LZ77_METRICS 0
+#endif
+
 
 namespace lz77 {
 
@@ -105,7 +120,21 @@ enum {
     DEFAULT_BLOCKSIZE = 64*1024,
     SHORTRUN_BITS = 3,
     SHORTRUN_MAX = (1 << SHORTRUN_BITS),
-    MIN_RUN = 5
+    MIN_RUN = 5,
+    DEFAULT_WINDOW = 64*1024,
+    APPEND_RESTART = 4*1024*1024,
+    ESTIMATE_BLOCKSIZE = 16*1024,
+    ESTIMATE_STRIDE = 4,
+    ESTIMATE_CALIBRATE = 16,
+    ESTIMATE_SLACK = 8,
+    PACE_BLOCKSIZE = 64*1024,
+    PACE_HYSTERESIS = 10,
+    LEVELS = 7,
+    REPEAT_MIN = 32,
+    REPEAT_INSERT = 4,
+    CHAIN_WINDOW_BITS = 20,
+    MATCH_ANCHOR = 4096,
+    PARALLEL_WINDOW_BITS = 22
 };
 
 
@@ -128,6 +157,37 @@ inline void push_vlq_uint(size_t n, std::string& out) {
     }
 }
 
+// Utility function: decode a size_t encoded with push_vlq_uint from a complete buffer.
+// Returns false if the buffer ends before the number does.
+
+inline bool read_vlq_uint(const unsigned char*& i, const unsigned char* e, size_t& res) {
+
+    size_t n = 0;
+    size_t off = 0;
+
+    while (1) {
+
+        if (i == e)
+            return false;
+
+        size_t c = *i;
+        ++i;
+
+        if (off >= sizeof(size_t) * 8)
+            throw std::runtime_error("Malformed data while uncompressing");
+
+        n |= ((c & 0x7F) << off);
+
+        if ((c & 0x80) == 0)
+            break;
+
+        off += 7;
+    }
+
+    res = n;
+    return true;
+}
+
 // Utility function: return common prefix length of two strings.
 
 inline size_t substr_run(const unsigned char* ai, const unsigned char* ae,
@@ -151,6 +211,33 @@ inline size_t substr_run(const unsigned char* ai, const unsigned char* ae,
     return n;
 }
 
+// Utility function: length of the repetition with period 'period' that starts at 'i',
+// i.e. of the match between 'i' and 'i - period'. Compares a word at a time;
+// the reads may overlap, since nothing is written.
+
+inline size_t repeat_run(const unsigned char* i, const unsigned char* e, size_t period) {
+
+    const unsigned char* b = i;
+
+    while (e - i >= 8) {
+
+        uint64_t x;
+        uint64_t y;
+        ::memcpy(&x, i, 8);
+        ::memcpy(&y, i - period, 8);
+
+        if (x != y)
+            break;
+
+        i += 8;
+    }
+
+    while (i != e && *i == *(i - period))
+        ++i;
+
+    return i - b;
+}
+
 // Utility function: Hash the first MIN_RUN bytes of a string into 16-bit ints.
 // (MIN_RUN is a magic constant.)
 // The hash function itself is important for compression quality.
@@ -175,6 +262,72 @@ inline void pack_bytes(const unsigned char* i, uint16_t& packed, size_t blocksiz
     packed = a % blocksize;
 }
 
+// Hash policies for the compressor: each hashes the first MIN_RUN bytes of a string.
+// Different data prefers different hashes; all of them make the same format.
+
+// FNV, as above. (The default.)
+
+struct fnv_hash_t {
+
+    static uint32_t hash(const unsigned char* i) {
+        return fnv32a(i, MIN_RUN);
+    }
+};
+
+// Multiply-shift: one 64-bit multiplication; the fastest.
+
+struct multiply_hash_t {
+
+    static uint32_t hash(const unsigned char* i) {
+
+        uint32_t lo;
+        ::memcpy(&lo, i, 4);
+
+        uint64_t v = lo | ((uint64_t)i[4] << 32);
+
+        return (v * (uint64_t)0x9E3779B97F4A7C15ULL) >> 32;
+    }
+};
+
+// CRC32C (Castagnoli), computed with a lookup table. (The same function as the
+// SSE4.2 'crc32' instruction, but kept portable.)
+
+struct crc32c_hash_t {
+
+    static const uint32_t* table() {
+
+        struct table_t {
+            uint32_t t[256];
+
+            table_t() {
+                for (uint32_t n = 0; n < 256; ++n) {
+                    uint32_t c = n;
+
+                    for (int k = 0; k < 8; ++k)
+                        c = (c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1);
+
+                    t[n] = c;
+                }
+            }
+        };
+
+        static const table_t t;
+        return t.t;
+    }
+
+    static uint32_t hash(const unsigned char* i) {
+
+        static const uint32_t* t = table();
+
+        uint32_t c = 0xFFFFFFFF;
+
+        for (size_t n = 0; n < MIN_RUN; ++n)
+            c = t[(c ^ i[n]) & 0xFF] ^ (c >> 8);
+
+        return ~c;
+    }
+};
+
 
 // Compute the profit from compression; 'run' is the length of a string at position 'offset'.
 // 'run' and 'offset' are numbers encoded as variable-length bitstreams; the sum length of 
@@ -214,263 +367,1876 @@ inline size_t gains(size_t run, size_t offset) {
     return gain - loss;
 }
 
-// Hash table already seen strings; it maps from a hash of a string prefix to
-// a list of offsets. (At each offset there is a string with a prefix that hashes
-// to the key.)
+// Token writers: the compressors output through these.
+// 'vlq' and 'bytes' return false if the output doesn't fit.
 
-struct offsets_dict_t {
+struct string_writer_t {
 
-    typedef std::vector<size_t> offsets_t;
-    offsets_t offsets;
+    std::string& out;
 
-    size_t searchlen;
-    size_t blocksize;
+    string_writer_t(std::string& o) : out(o) {}
 
-    offsets_dict_t(size_t sl, size_t bs) : searchlen(sl), blocksize(bs) {
+    bool vlq(size_t n) {
+        push_vlq_uint(n, out);
+        return true;
+    }
 
-        offsets.resize((searchlen + 1) * blocksize);
+    bool bytes(const unsigned char* i, size_t n) {
+        out.append((const char*)i, n);
+        return true;
     }
+};
 
-    void clear() {
-        offsets.assign((searchlen + 1) * blocksize, 0);
+struct buffer_writer_t {
+
+    unsigned char* out;
+    unsigned char* oute;
+
+    buffer_writer_t(unsigned char* o, unsigned char* oe) : out(o), oute(oe) {}
+
+    bool vlq(size_t n) {
+
+        while (1) {
+
+            if (out == oute)
+                return false;
+
+            unsigned char c = n & 0x7F;
+            size_t q = n >> 7;
+
+            if (q == 0) {
+                *out = c;
+                ++out;
+                return true;
+            }
+
+            *out = (c | 0x80);
+            ++out;
+            n = q;
+        }
     }
-        
-    // Functions for a simple circular buffer data structure.
 
-    static size_t* prev(size_t* b, size_t* e, size_t* i) {
+    bool bytes(const unsigned char* i, size_t n) {
 
-        if (i == b)
-            i = e;
+        if (n > (size_t)(oute - out))
+            return false;
 
-        --i;
-        return i;
+        ::memcpy(out, i, n);
+        out += n;
+        return true;
     }
+};
 
-    static size_t push_back(size_t* b, size_t* e, size_t* head, size_t val) {
+// Counts the output size without storing anything.
 
-        *head = val;
-        ++head;
+struct count_writer_t {
 
-        if (head == e)
-            head = b;
+    size_t size;
 
-        return head - b;
+    count_writer_t() : size(0) {}
+
+    bool vlq(size_t n) {
+
+        do {
+            ++size;
+            n = n >> 7;
+        } while (n > 0);
+
+        return true;
     }
-    
-    void operator()(uint16_t packed, const unsigned char* i0, const unsigned char* i, const unsigned char* e,
-                    size_t& maxrun, size_t& maxoffset, size_t& maxgain) {
 
-        // Select a range of values representing a circular buffer.
-        // The first value is the index of the buffer head, the rest are
-        // the values of the buffer itself. 
+    bool bytes(const unsigned char* i, size_t n) {
+        size += n;
+        return true;
+    }
+};
 
-        size_t* cb_start = &offsets[packed * (searchlen + 1)];
+// Counts the output size of each block of 'blocksize' bytes of the input, by where
+// each token starts; follows the token format to know where that is.
+// (Used by estimate_compressed_size().)
 
-        size_t* cb_beg = (cb_start + 1);
-        size_t* cb_end = (cb_start + 1 + searchlen);
-        size_t* cb_head = cb_beg + *cb_start;
+struct block_count_writer_t {
 
-        size_t* cb_i = cb_head;
+    const unsigned char* b;
+    size_t blocksize;
+    std::vector<size_t> sizes;
+    size_t pos;
+    bool run_follows;
 
-        while (1) {
+    block_count_writer_t(const unsigned char* _b, size_t n, size_t bs) :
+        b(_b), blocksize(bs), sizes(n / bs + 1), pos(0), run_follows(false) {}
 
-            cb_i = prev(cb_beg, cb_end, cb_i);
+    bool vlq(size_t n) {
 
-            if (*cb_i == 0)
-                break;
+        count_writer_t c;
+        c.vlq(n);
+        sizes[pos / blocksize] += c.size;
 
-            // The stored value is position + 1 to allow 0 to mean 'uninitialized offset'.
-            size_t pos = *cb_i - 1;
+        if (run_follows) {
+            pos += n + MIN_RUN - 1;
+            run_follows = false;
 
-            size_t offset = i - i0 - pos;
-            size_t run = substr_run(i, e, i0 + pos, e);
-            size_t gain = gains(run, offset);
+        } else if ((n & 1) == 0) {
 
-            if (gain > maxgain) {
-                maxrun = run;
-                maxoffset = offset;
-                maxgain = gain;
-            }
+            size_t run = (n >> 1) & (SHORTRUN_MAX - 1);
 
-            if (cb_i == cb_head)
-                break;
+            if (run > 0)
+                pos += run + MIN_RUN - 1;
+            else
+                run_follows = true;
         }
 
-        *cb_start = push_back(cb_beg, cb_end, cb_head, i - i0 + 1);
+        return true;
     }
-};
 
-/*
- * 
- * Entry point for compression.
- * 
- * Inputs: std::string of data to be compressed.
- *
- * Also optionally parameters for tuning speed and quality.
- *
- * There are two parameters: 'searchlen' and 'blocksize'.
- *
- * 'blocksize' is the upper bound for hash table sizes.
- * 'searchlen' is the upper bound for lists of offsets at each hash value.
- *
- * A larger 'searchlen' increases compression quality, running time and memory consumption. 
- * A larger 'blocksize' increases memory consumption and compression quality. 
- *
- * If you want faster compression at the expense of quality, try lowering searchlen.
- *
- * If you only ever compress short strings, try lowering blocksize to save memory.
- *
- * Output: the compressed data as a string.
- */
+    // (Literals go to the blocks they come from.)
 
-struct compress_t {
+    bool bytes(const unsigned char* i, size_t n) {
 
-    offsets_dict_t offsets;
+        pos = i - b;
 
-    compress_t(size_t searchlen = DEFAULT_SEARCHLEN, size_t blocksize = DEFAULT_BLOCKSIZE) :
-        offsets(searchlen, blocksize) {}
-    
-    std::string feed(const unsigned char* i, const unsigned char* e) {
+        while (n > 0) {
+            size_t l = std::min(n, blocksize - pos % blocksize);
+            sizes[pos / blocksize] += l;
+            pos += l;
+            n -= l;
+        }
 
-        const unsigned char* i0 = i;
+        return true;
+    }
+};
 
-        std::string ret;
-        
-        std::string unc;
+// Write a packet of uncompressed data.
 
-        push_vlq_uint(e - i, ret);
+template <typename WRITER>
+inline bool write_literals(WRITER& w, const unsigned char* i, size_t n) {
 
-        offsets.clear();
+    return w.vlq((n << 1) | 1) && w.bytes(i, n);
+}
 
-        size_t blocksize = offsets.blocksize;
+// A compressed string is a length and an offset.
+// First subtract the minimum length (smaller lengths don't exist).
+// Then check if the length fits in SHORTRUN_BITS bits; if it does, then
+// tack it on to the offset. Otherwise write length and offset separately.
+// The rightmost bit is a zero to differentiate from packets of
+// uncompressed data.
 
-        while (i != e) {
+template <typename WRITER>
+inline bool write_match(WRITER& w, size_t run, size_t offset) {
 
-            unsigned char c = *i;
+    run = run - MIN_RUN + 1;
 
-            // The last MIN_RUN-1 bytes are uncompressable. (At least MIN_RUN bytes
-            // are needed to calculate a prefix hash.)
+    if (run < SHORTRUN_MAX)
+        return w.vlq(((offset << SHORTRUN_BITS) | run) << 1);
 
-            if (i > e - MIN_RUN) {
+    return w.vlq(offset << (SHORTRUN_BITS + 1)) && w.vlq(run);
+}
 
-                unc +=c;
-                ++i;
-                continue;
-            }
+/*
+ * Optional instrumentation: latency histograms of compress_t::feed and
+ * decompress_t::feed, bucketed by the size of the input of each call.
+ *
+ * Off unless compiled with -DLZ77_METRICS=1; when off, the timers are empty
+ * objects and nothing is recorded or allocated.
+ *
+ * Each thread records into its own histograms, without locks or atomic
+ * read-modify-writes; metrics_snapshot() sums all threads (including finished
+ * ones) into a metrics_t, e.g. from a metrics exporter thread.
+ */
 
-            size_t maxrun = 0;
-            size_t maxoffset = 0;
-            size_t maxgain = 0;
+enum {
+    HIST_SUB_BITS = 3,
+    HIST_SUB = (1 << HIST_SUB_BITS),
+    HIST_BUCKETS = HIST_SUB + (64 - HIST_SUB_BITS) * HIST_SUB,
+    SIZE_CLASSES = 8
+};
 
-            uint16_t packed;
+// Log-linear buckets, as in HDR histograms: values below HIST_SUB are exact,
+// above that each power of two is split into HIST_SUB buckets. (At most 12.5% error.)
 
-            // The MIN_RUN prefix length was chosen empirically, based on a series
-            // of unscientific tests.
+inline size_t hist_bucket(uint64_t v) {
 
-            pack_bytes(i, packed, blocksize);
+    if (v < HIST_SUB)
+        return v;
 
-            offsets(packed, i0, i, e, maxrun, maxoffset, maxgain);
+    size_t exp = 0;
 
-            if (maxrun < MIN_RUN) {
-                unc += c;
-                ++i;
-                continue;
-            }
+    while (v >= 2 * HIST_SUB) {
+        v >>= 1;
+        ++exp;
+    }
+
+    return HIST_SUB + exp * HIST_SUB + (v - HIST_SUB);
+}
 
-            if (unc.size() > 0) {
-                // Write a packet of uncompressed data.
+// The largest value that falls into a bucket.
 
-                size_t msg = (unc.size() << 1) | 1;
-                push_vlq_uint(msg, ret);
-                ret += unc;
-                unc.clear();
-            }
+inline uint64_t hist_bucket_limit(size_t b) {
 
-            // A compressed string is a length and an offset.
-            // First subtract the minimum length (smaller lengths don't exist).
-            // Then check if the length fits in SHORTRUN_BITS bits; if it does, then
-            // tack it on to the offset. Otherwise write length and offset separately.
-            // The rightmost bit is a zero to differentiate from packets of
-            // uncompressed data.
+    if (b < HIST_SUB)
+        return b;
 
-            i += maxrun;
-            maxrun = maxrun - MIN_RUN + 1;
+    size_t exp = (b - HIST_SUB) / HIST_SUB;
+    uint64_t v = HIST_SUB + (b - HIST_SUB) % HIST_SUB;
 
-            if (maxrun < SHORTRUN_MAX) {
+    return ((v + 1) << exp) - 1;
+}
 
-                size_t msg = ((maxoffset << SHORTRUN_BITS) | maxrun) << 1;
-                push_vlq_uint(msg, ret);
+// Size class of a call: [0, 1K), [1K, 4K), [4K, 16K), ... [4M, inf).
 
-            } else {
+inline size_t size_class(size_t n) {
 
-                size_t msg = (maxoffset << (SHORTRUN_BITS + 1));
-                push_vlq_uint(msg, ret);
-                push_vlq_uint(maxrun, ret);
-            }
-        }
+    size_t c = 0;
 
-        if (unc.size() > 0) {
+    for (size_t limit = 1024; c + 1 < SIZE_CLASSES && n >= limit; limit *= 4)
+        ++c;
 
-            size_t msg = (unc.size() << 1) | 1;
-            push_vlq_uint(msg, ret);
-            ret += unc;
-            unc.clear();
-        }
+    return c;
+}
 
-        return ret;
+struct histogram_t {
+
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+
+    histogram_t() : count(0), sum(0), max(0) {
+        ::memset(counts, 0, sizeof(counts));
     }
 
-    std::string feed(const std::string& s) {
+    void add(uint64_t v) {
+        ++counts[hist_bucket(v)];
+        ++count;
+        sum += v;
 
-        const unsigned char* i = (const unsigned char*)s.data();
-        const unsigned char* e = i + s.size();
-        return feed(i, e);
+        if (v > max)
+            max = v;
     }
-};
 
-/*
- * Entry point for decompression.
- * Calling 'feed' and 'result' out of order is undefined behaviour 
- * and will crash your program.
- */
+    void merge(const histogram_t& h) {
 
-struct decompress_t {
+        for (size_t b = 0; b < HIST_BUCKETS; ++b)
+            counts[b] += h.counts[b];
 
-    size_t max_size;
-    std::string ret;
-    unsigned char* out;
-    unsigned char* outb;
-    unsigned char* oute;
+        count += h.count;
+        sum += h.sum;
 
-    struct state_t {
-        size_t msg;
-        size_t run;
-        size_t vlq_num;
-        size_t vlq_off;
-        enum {
-            INIT,
-            START,
-            READ_DATA,
-            READ_RUN
-        } state;
+        if (h.max > max)
+            max = h.max;
+    }
 
-        state_t() : msg(0), run(0), vlq_num(0), vlq_off(0), state(INIT) {}
-    };
+    // E.g. percentile(0.99) for the p99; an upper bound within one bucket.
 
-    state_t state;
+    uint64_t percentile(double p) const {
 
-    // Utility function: decode variable-length-coded unsigned integers.
+        if (count == 0)
+            return 0;
 
-    bool pop_vlq_uint(const unsigned char*& i, const unsigned char* e, size_t& res) {
+        uint64_t rank = (uint64_t)(p * count + 0.5);
 
-        while (1) {
+        if (rank < 1)
+            rank = 1;
 
-            if (i == e)
-                return false;
+        uint64_t n = 0;
 
-            size_t c = *i;
+        for (size_t b = 0; b < HIST_BUCKETS; ++b) {
+            n += counts[b];
 
-            if ((c & 0x80) == 0) {
+            if (n >= rank)
+                return std::min(hist_bucket_limit(b), max);
+        }
+
+        return max;
+    }
+};
+
+struct call_metrics_t {
+
+    // Nanoseconds per call, by size_class() of the input.
+    histogram_t latency[SIZE_CLASSES];
+
+    // Input bytes per call.
+    histogram_t bytes;
+
+    void merge(const call_metrics_t& m) {
+
+        for (size_t c = 0; c < SIZE_CLASSES; ++c)
+            latency[c].merge(m.latency[c]);
+
+        bytes.merge(m.bytes);
+    }
+};
+
+struct metrics_t {
+
+    enum {
+        COMPRESS = 0,
+        DECOMPRESS = 1,
+        CALLS = 2
+    };
+
+    call_metrics_t calls[CALLS];
+
+    void merge(const metrics_t& m) {
+
+        for (size_t k = 0; k < CALLS; ++k)
+            calls[k].merge(m.calls[k]);
+    }
+};
+
+// A thread's own histograms, which the snapshot reads while the thread writes.
+// Only the owning thread writes, so relaxed loads and stores are enough (and
+// compile to plain moves on x86-64); the snapshot may be a few calls behind.
+
+struct live_histogram_t {
+
+    std::atomic<uint64_t> counts[HIST_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+
+    live_histogram_t() : count(0), sum(0), max(0) {
+
+        for (size_t b = 0; b < HIST_BUCKETS; ++b)
+            counts[b].store(0, std::memory_order_relaxed);
+    }
+
+    static void bump(std::atomic<uint64_t>& c, uint64_t v) {
+        c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    }
+
+    void add(uint64_t v) {
+        bump(counts[hist_bucket(v)], 1);
+        bump(count, 1);
+        bump(sum, v);
+
+        if (v > max.load(std::memory_order_relaxed))
+            max.store(v, std::memory_order_relaxed);
+    }
+
+    void merge_into(histogram_t& h) const {
+
+        for (size_t b = 0; b < HIST_BUCKETS; ++b)
+            h.counts[b] += counts[b].load(std::memory_order_relaxed);
+
+        h.count += count.load(std::memory_order_relaxed);
+        h.sum += sum.load(std::memory_order_relaxed);
+
+        uint64_t m = max.load(std::memory_order_relaxed);
+
+        if (m > h.max)
+            h.max = m;
+    }
+};
+
+struct live_metrics_t {
+
+    live_histogram_t latency[metrics_t::CALLS][SIZE_CLASSES];
+    live_histogram_t bytes[metrics_t::CALLS];
+
+    void merge_into(metrics_t& m) const {
+
+        for (size_t k = 0; k < metrics_t::CALLS; ++k) {
+
+            for (size_t c = 0; c < SIZE_CLASSES; ++c)
+                latency[k][c].merge_into(m.calls[k].latency[c]);
+
+            bytes[k].merge_into(m.calls[k].bytes);
+        }
+    }
+};
+
+// The histograms of all threads. A thread's histograms are merged into
+// 'retired' when the thread exits.
+
+struct metrics_registry_t {
+
+    std::mutex mutex;
+    std::vector<const live_metrics_t*> live;
+    metrics_t retired;
+
+    static metrics_registry_t& get() {
+        static metrics_registry_t r;
+        return r;
+    }
+};
+
+struct thread_metrics_t {
+
+    live_metrics_t m;
+
+    thread_metrics_t() {
+        metrics_registry_t& r = metrics_registry_t::get();
+        std::lock_guard<std::mutex> l(r.mutex);
+        r.live.push_back(&m);
+    }
+
+    ~thread_metrics_t() {
+        metrics_registry_t& r = metrics_registry_t::get();
+        std::lock_guard<std::mutex> l(r.mutex);
+        r.live.erase(std::find(r.live.begin(), r.live.end(), &m));
+        m.merge_into(r.retired);
+    }
+
+    void record(size_t call, size_t bytes, uint64_t nanos) {
+        m.latency[call][size_class(bytes)].add(nanos);
+        m.bytes[call].add(bytes);
+    }
+
+    static thread_metrics_t& get() {
+        static thread_local thread_metrics_t t;
+        return t;
+    }
+};
+
+inline metrics_t metrics_snapshot() {
+
+    metrics_registry_t& r = metrics_registry_t::get();
+    std::lock_guard<std::mutex> l(r.mutex);
+
+    metrics_t ret = r.retired;
+
+    for (const live_metrics_t* m : r.live)
+        m->merge_into(ret);
+
+    return ret;
+}
+
+// Times one call and records it when it goes out of scope.
+
+template <bool ENABLED>
+struct call_timer_t {
+
+    size_t call;
+    size_t bytes;
+    std::chrono::steady_clock::time_point start;
+
+    call_timer_t(size_t _call, size_t _bytes) : call(_call), bytes(_bytes), start(std::chrono::steady_clock::now()) {}
+
+    ~call_timer_t() {
+        std::chrono::nanoseconds d = std::chrono::steady_clock::now() - start;
+        thread_metrics_t::get().record(call, bytes, d.count());
+    }
+};
+
+template <>
+struct call_timer_t<false> {
+    call_timer_t(size_t, size_t) {}
+};
+
+// Hash table already seen strings; it maps from a hash of a string prefix to
+// a list of offsets. (At each offset there is a string with a prefix that hashes
+// to the key.)
+
+struct offsets_dict_t {
+
+    typedef std::vector<size_t> offsets_t;
+    offsets_t offsets;
+
+    size_t searchlen;
+    size_t blocksize;
+
+    // How many of the most recent offsets are checked; at most 'searchlen'.
+    size_t depth;
+
+    offsets_dict_t(size_t sl, size_t bs) : searchlen(sl), blocksize(bs), depth(sl) {
+
+        offsets.resize((searchlen + 1) * blocksize);
+    }
+
+    void clear() {
+        offsets.assign((searchlen + 1) * blocksize, 0);
+    }
+
+    // Record a position without searching. (Used for priming the table with history.)
+
+    void insert(uint16_t packed, size_t pos) {
+
+        size_t* cb_start = &offsets[packed * (searchlen + 1)];
+
+        size_t* cb_beg = (cb_start + 1);
+        size_t* cb_end = (cb_start + 1 + searchlen);
+        size_t* cb_head = cb_beg + *cb_start;
+
+        *cb_start = push_back(cb_beg, cb_end, cb_head, pos + 1);
+    }
+        
+    // Functions for a simple circular buffer data structure.
+
+    static size_t* prev(size_t* b, size_t* e, size_t* i) {
+
+        if (i == b)
+            i = e;
+
+        --i;
+        return i;
+    }
+
+    static size_t push_back(size_t* b, size_t* e, size_t* head, size_t val) {
+
+        *head = val;
+        ++head;
+
+        if (head == e)
+            head = b;
+
+        return head - b;
+    }
+    
+    void operator()(uint16_t packed, const unsigned char* i0, const unsigned char* i, const unsigned char* e,
+                    size_t& maxrun, size_t& maxoffset, size_t& maxgain) {
+
+        // Select a range of values representing a circular buffer.
+        // The first value is the index of the buffer head, the rest are
+        // the values of the buffer itself. 
+
+        size_t* cb_start = &offsets[packed * (searchlen + 1)];
+
+        size_t* cb_beg = (cb_start + 1);
+        size_t* cb_end = (cb_start + 1 + searchlen);
+        size_t* cb_head = cb_beg + *cb_start;
+
+        size_t* cb_i = cb_head;
+        size_t n = depth;
+
+        while (n > 0) {
+
+            --n;
+
+            cb_i = prev(cb_beg, cb_end, cb_i);
+
+            if (*cb_i == 0)
+                break;
+
+            // The stored value is position + 1 to allow 0 to mean 'uninitialized offset'.
+            size_t pos = *cb_i - 1;
+
+            size_t offset = i - i0 - pos;
+            size_t run = substr_run(i, e, i0 + pos, e);
+            size_t gain = gains(run, offset);
+
+            if (gain > maxgain) {
+                maxrun = run;
+                maxoffset = offset;
+                maxgain = gain;
+            }
+
+            if (cb_i == cb_head)
+                break;
+        }
+
+        *cb_start = push_back(cb_beg, cb_end, cb_head, i - i0 + 1);
+    }
+};
+
+// The classic alternative to offsets_dict_t: a hash chain. 'head' holds the
+// most recent position for each hash value, and 'prev' links each position to
+// the previous one with the same hash, for the last 2^window_bits positions.
+// The chains have no fixed length, so 'depth' can be anything; memory is
+// 4 bytes per hash value plus 4 bytes per window position, used or not.
+// Offsets are limited to the window; inputs to 4 gigabytes.
+
+struct chain_dict_t {
+
+    std::vector<uint32_t> head;
+    std::vector<uint32_t> prev;
+    size_t mask;
+
+    // How many positions of a chain are checked.
+    size_t depth;
+
+    chain_dict_t() : mask(0), depth(0) {}
+
+    void init(size_t blocksize, size_t window_bits, size_t _depth) {
+        head.assign(blocksize, 0);
+        prev.resize((size_t)1 << window_bits);
+        mask = prev.size() - 1;
+        depth = _depth;
+    }
+
+    // (No need to clear 'prev': only links written since the last clear are reachable.)
+
+    void clear() {
+        head.assign(head.size(), 0);
+    }
+
+    // The stored values are position + 1, so that 0 means 'no position'.
+
+    void insert(uint16_t packed, size_t pos) {
+        prev[pos & mask] = head[packed];
+        head[packed] = pos + 1;
+    }
+
+    void operator()(uint16_t packed, const unsigned char* i0, const unsigned char* i, const unsigned char* e,
+                    size_t& maxrun, size_t& maxoffset, size_t& maxgain) {
+
+        size_t here = i - i0;
+        size_t next = head[packed];
+
+        for (size_t n = depth; n > 0 && next != 0; --n) {
+
+            size_t pos = next - 1;
+            size_t offset = here - pos;
+
+            if (offset > mask)
+                break;
+
+            size_t run = substr_run(i, e, i0 + pos, e);
+            size_t gain = gains(run, offset);
+
+            if (gain > maxgain) {
+                maxrun = run;
+                maxoffset = offset;
+                maxgain = gain;
+            }
+
+            next = prev[pos & mask];
+
+            if (next - 1 >= pos)
+                break;
+        }
+
+        insert(packed, here);
+    }
+};
+
+/*
+ * 
+ * Entry point for compression.
+ * 
+ * Inputs: std::string of data to be compressed.
+ *
+ * Also optionally parameters for tuning speed and quality.
+ *
+ * There are two parameters: 'searchlen' and 'blocksize'.
+ *
+ * 'blocksize' is the upper bound for hash table sizes.
+ * 'searchlen' is the upper bound for lists of offsets at each hash value.
+ *
+ * A larger 'searchlen' increases compression quality, running time and memory consumption. 
+ * A larger 'blocksize' increases memory consumption and compression quality. 
+ *
+ * If you want faster compression at the expense of quality, try lowering searchlen.
+ *
+ * If you only ever compress short strings, try lowering blocksize to save memory.
+ *
+ * The optional 'window' parameter enables append mode: each call to 'feed' produces
+ * a frame that can reference up to 'window' bytes of the data fed in previous calls.
+ * This is useful for continuously appending small chunks to one compressed file.
+ * Frames made in append mode need a 'decompress_t' with the same 'window' and
+ * must be decoded in order.
+ *
+ * Append-mode frames are marked, so that a decoder without a window rejects them
+ * instead of misreading them: the frame size ends in an empty 7-bit group, which
+ * push_vlq_uint() never writes. Each frame is followed by a trailer,
+ * vlq(frame length << 1 | restart) and then the length of that vlq in one byte,
+ * so that the frames can be walked back from the end of a file. 'restart' is set
+ * when the frame doesn't reference any history; one frame in every APPEND_RESTART
+ * bytes of input or so is made that way, so the history at the end of a file can
+ * be recovered by decoding its last frames only.
+ *
+ * The template parameter is the hash policy (fnv_hash_t, multiply_hash_t or
+ * crc32c_hash_t); 'compress_t' uses the default.
+ *
+ * Output: the compressed data as a string.
+ */
+
+template <typename HASH = fnv_hash_t>
+struct basic_compress_t {
+
+    offsets_dict_t offsets;
+
+    // Used instead of 'offsets' after set_chains().
+    chain_dict_t chains;
+    bool chained;
+    size_t chain_depth;
+
+    size_t window;
+    std::string history;
+
+    // Append mode: bytes fed since the last frame made without history.
+    size_t since_restart;
+
+    // Set by set_level().
+    size_t level;
+    bool lazy;
+    size_t accel;
+
+    // Set by set_throughput() or feed(i, e, seconds).
+    double throughput;
+
+    // Set by set_threads().
+    size_t nthreads;
+
+    typedef std::chrono::steady_clock clock_type;
+
+    struct pace_t {
+        clock_type::time_point start;
+        clock_type::time_point last;
+        double seconds;
+        size_t total;
+        size_t done;
+
+        // Bytes done, weighted by the level's cost, and the time they took.
+        double work;
+        double busy;
+
+        pace_t() : seconds(0), total(0), done(0), work(0), busy(0) {}
+    };
+
+    pace_t pace;
+
+    basic_compress_t(size_t searchlen = DEFAULT_SEARCHLEN, size_t blocksize = DEFAULT_BLOCKSIZE, size_t _window = 0) :
+        offsets(searchlen, blocksize), chained(false), chain_depth(0), window(_window), since_restart(0), level(LEVELS - 2), lazy(false), accel(0), throughput(0), nthreads(0) {}
+
+    /*
+     * Find matches with hash chains (chain_dict_t) over a window of the last
+     * 2^window_bits bytes, instead of with the buckets. 'depth' takes the place
+     * of 'searchlen': the levels check up to that many positions of a chain.
+     * Chains can be deeper than the buckets at less memory, but can't see past the window.
+     * Pass 0 to go back to the buckets. (Only the finder in use has its memory allocated.)
+     */
+
+    void set_chains(size_t depth, size_t window_bits = CHAIN_WINDOW_BITS) {
+
+        chained = (depth > 0);
+        chain_depth = depth;
+
+        if (chained) {
+            chains.init(offsets.blocksize, window_bits, depth);
+            offsets.offsets = offsets_dict_t::offsets_t();
+
+        } else {
+            chains = chain_dict_t();
+            offsets.clear();
+        }
+
+        set_level(level);
+    }
+
+    // The match finder in use.
+
+    void index_clear() {
+
+        if (chained)
+            chains.clear();
+        else
+            offsets.clear();
+    }
+
+    void index_insert(uint16_t packed, size_t pos) {
+
+        if (chained)
+            chains.insert(packed, pos);
+        else
+            offsets.insert(packed, pos);
+    }
+
+    void find(uint16_t packed, const unsigned char* i0, const unsigned char* i, const unsigned char* e,
+              size_t& maxrun, size_t& maxoffset, size_t& maxgain) {
+
+        if (chained)
+            chains(packed, i0, i, e, maxrun, maxoffset, maxgain);
+        else
+            offsets(packed, i0, i, e, maxrun, maxoffset, maxgain);
+    }
+
+    /*
+     * Levels trade compression quality for speed, from 0 (fastest) to LEVELS-1:
+     *
+     *   0: check one offset per hash, and skip ahead faster and faster while nothing matches.
+     *   1: check one offset per hash.
+     *   2, 3, 4: check 2, 4, 8 offsets.
+     *   5: check all 'searchlen' offsets. (The default.)
+     *   6: also look for a better match one byte ahead before taking a match. ('Lazy matching'.)
+     *
+     * The number of offsets is capped by 'searchlen' (or by the chain depth, see set_chains()).
+     */
+
+    void set_level(size_t l) {
+
+        static const size_t depths[LEVELS] = { 1, 1, 2, 4, 8, 0, 0 };
+
+        if (l >= LEVELS)
+            l = LEVELS - 1;
+
+        level = l;
+
+        size_t d = depths[l];
+        offsets.depth = (d == 0 || d > offsets.searchlen ? offsets.searchlen : d);
+        chains.depth = (d == 0 || d > chain_depth ? chain_depth : d);
+
+        lazy = (l == LEVELS - 1);
+        accel = (l == 0 ? 4 : 0);
+    }
+
+    /*
+     * Adaptive mode: compress at about 'bytes_per_sec' or faster.
+     * Every PACE_BLOCKSIZE bytes of input the best level that can do the rest of
+     * the input in time is picked, by the speed so far and the relative cost of
+     * the levels. Level 0 is the last resort. Pass 0 to turn it off.
+     *
+     * The output is in the usual format.
+     */
+
+    void set_throughput(double bytes_per_sec) {
+        throughput = bytes_per_sec;
+    }
+
+    /*
+     * Append mode: set the history that the next frame may reference.
+     * Pass the tail of the uncompressed data that was written so far,
+     * e.g. to continue appending to an existing file after a restart.
+     */
+
+    void prime(const unsigned char* i, const unsigned char* e) {
+
+        if ((size_t)(e - i) > window)
+            i = e - window;
+
+        history.assign(i, e);
+    }
+
+    void prime(const std::string& s) {
+
+        const unsigned char* i = (const unsigned char*)s.data();
+        const unsigned char* e = i + s.size();
+        prime(i, e);
+    }
+
+    std::string feed(const unsigned char* i, const unsigned char* e) {
+
+        call_timer_t<LZ77_METRICS> _t(metrics_t::COMPRESS, e - i);
+
+        if (window == 0) {
+            std::string ret;
+            encode(i, i, e, ret);
+            return ret;
+        }
+
+        // Append mode: compress the input as a continuation of the history,
+        // or without it every APPEND_RESTART bytes.
+
+        if (since_restart >= APPEND_RESTART) {
+            history.clear();
+            since_restart = 0;
+        }
+
+        bool restart = history.empty();
+        since_restart += e - i;
+
+        std::string buf;
+        buf.reserve(history.size() + (e - i));
+        buf.assign(history);
+        buf.append(i, e);
+
+        const unsigned char* b = (const unsigned char*)buf.data();
+        const unsigned char* be = b + buf.size();
+
+        std::string ret;
+        encode(b, b + history.size(), be, ret);
+
+        prime(b, be);
+
+        // Mark the frame and add the trailer.
+
+        count_writer_t header;
+        header.vlq(e - i);
+
+        ret[header.size - 1] |= 0x80;
+        ret.insert(header.size, 1, '\0');
+
+        size_t trailer = ret.size();
+        push_vlq_uint((ret.size() << 1) | (restart ? 1 : 0), ret);
+        ret += (char)(ret.size() - trailer);
+
+        return ret;
+    }
+
+    std::string feed(const std::string& s) {
+
+        const unsigned char* i = (const unsigned char*)s.data();
+        const unsigned char* e = i + s.size();
+        return feed(i, e);
+    }
+
+    /*
+     * Adaptive mode for one call: compress [i, e) within about 'seconds', using the
+     * best levels that fit. (If even level 0 is too slow the deadline is missed.)
+     */
+
+    std::string feed(const unsigned char* i, const unsigned char* e, double seconds) {
+
+        double saved = throughput;
+        size_t saved_level = level;
+
+        throughput = (seconds > 0 ? (e - i) / seconds : 0);
+        std::string ret = feed(i, e);
+        throughput = saved;
+
+        set_level(saved_level);
+
+        return ret;
+    }
+
+    std::string feed(const std::string& s, double seconds) {
+
+        const unsigned char* i = (const unsigned char*)s.data();
+        const unsigned char* e = i + s.size();
+        return feed(i, e, seconds);
+    }
+
+    // Adaptive mode: called every PACE_BLOCKSIZE bytes with the number of bytes done so far.
+
+    void pace_start(size_t total) {
+
+        pace.start = clock_type::now();
+        pace.last = pace.start;
+        pace.seconds = total / throughput;
+        pace.total = total;
+        pace.done = 0;
+        pace.work = 0;
+        pace.busy = 0;
+    }
+
+    void pace_step(size_t done) {
+
+        // The cost of a byte at each level, in percent of level 1, measured on text,
+        // binaries and mixed data. Level 0 has no place in this order: it skips ahead
+        // while nothing matches, which makes it up to 100 times faster than level 1
+        // on random data but up to 10% slower on text. So it is only used when level 1
+        // is too slow, and counts as level 1 for the speed so far.
+
+        static const size_t costs[LEVELS] = { 100, 100, 110, 140, 190, 230, 350 };
+
+        clock_type::time_point now = clock_type::now();
+        double elapsed = std::chrono::duration<double>(now - pace.start).count();
+
+        pace.work += (done - pace.done) * costs[level] / 100.0;
+        pace.busy += std::chrono::duration<double>(now - pace.last).count();
+        pace.last = now;
+        pace.done = done;
+
+        if (pace.busy <= 0)
+            return;
+
+        // Aim to finish at 90% of the time budget.
+
+        double left = 0.9 * pace.seconds - elapsed;
+        double rest = pace.total - done;
+
+        // The best level that does the rest in time at the speed so far. Moving up
+        // takes a margin of PACE_HYSTERESIS percent, so that noise doesn't flip the
+        // level back and forth.
+
+        double rate = pace.work / pace.busy;
+        size_t next = 0;
+
+        for (size_t l = LEVELS - 1; l > 0; --l) {
+
+            double margin = (l > level ? 1.0 + PACE_HYSTERESIS / 100.0 : 1.0);
+
+            if (rest * costs[l] / 100.0 * margin <= rate * left) {
+                next = l;
+                break;
+            }
+        }
+
+        set_level(next);
+    }
+
+    /*
+     * Estimate the compressed size of [i, e) without making the output.
+     *
+     * With 'sampling' = 1 the whole input is parsed and the estimate is exact.
+     * With 'sampling' = N only every N-th block of ESTIMATE_BLOCKSIZE bytes is
+     * parsed and the result is extrapolated; 'error' is then the half-width
+     * of a 95% confidence interval around 'size'.
+     *
+     * The sampled blocks see only part of the history, so they don't compress
+     * quite as in the real parse (within 3% either way, with every ESTIMATE_STRIDE-th
+     * position of the other blocks indexed). The first ESTIMATE_CALIBRATE sampled
+     * blocks are also parsed for real, in order with everything before them, and
+     * the ratio of their real to their sampled sizes corrects the estimate. 'error'
+     * includes the uncertainty of that ratio, the correction itself (the ratio can
+     * drift along the input) and ESTIMATE_SLACK bytes per block. Inputs too small
+     * for that are parsed whole.
+     *
+     * (Append mode history is not taken into account.)
+     */
+
+    struct estimate_t {
+        size_t size;
+        size_t error;
+    };
+
+    estimate_t estimate_compressed_size(const unsigned char* i, const unsigned char* e, size_t sampling = 1) {
+
+        estimate_t ret;
+        ret.error = 0;
+
+        size_t n = e - i;
+        size_t nblocks = (n + ESTIMATE_BLOCKSIZE - 1) / ESTIMATE_BLOCKSIZE;
+        size_t nsamples = (sampling > 0 ? (nblocks + sampling - 2) / sampling : 0);
+
+        if (sampling <= 1 || nsamples <= 2 * ESTIMATE_CALIBRATE) {
+            count_writer_t w;
+            parse(i, i, e, w);
+            ret.size = w.size;
+            return ret;
+        }
+
+        // The real sizes of the first ESTIMATE_CALIBRATE sampled blocks.
+
+        size_t prefix = ((ESTIMATE_CALIBRATE - 1) * sampling + 1) * ESTIMATE_BLOCKSIZE;
+
+        block_count_writer_t cw(i, prefix, ESTIMATE_BLOCKSIZE);
+
+        index_clear();
+        tokens(i, i, i + prefix, cw);
+
+        std::vector<double> real;
+
+        for (size_t j = 0; j < ESTIMATE_CALIBRATE; ++j)
+            real.push_back(cw.sizes[j * sampling]);
+
+        index_clear();
+
+        // Blocks that aren't sampled are still indexed at every ESTIMATE_STRIDE-th
+        // position, so that the sampled blocks find most of the long-range matches
+        // that the real parse would find.
+
+        size_t blocksize = offsets.blocksize;
+
+        std::vector<double> sampled;
+
+        for (size_t b = 0; b + 1 < nblocks; b += sampling) {
+
+            const unsigned char* bi = i + b * ESTIMATE_BLOCKSIZE;
+
+            if (b > 0) {
+
+                for (const unsigned char* h = bi - (sampling - 1) * ESTIMATE_BLOCKSIZE; h < bi; h += ESTIMATE_STRIDE) {
+
+                    uint16_t packed;
+                    packed = HASH::hash(h) % blocksize;
+                    index_insert(packed, h - i);
+                }
+            }
+
+            count_writer_t w;
+            tokens(i, bi, bi + ESTIMATE_BLOCKSIZE, w);
+            sampled.push_back(w.size);
+        }
+
+        // The mean size of a sampled block and its variance, as a fraction of the block.
+
+        size_t k = sampled.size();
+        double sum = 0;
+        double sum2 = 0;
+
+        for (size_t j = 0; j < k; ++j) {
+            double r = sampled[j] / ESTIMATE_BLOCKSIZE;
+            sum += r;
+            sum2 += r * r;
+        }
+
+        double mean = sum / k;
+        double var = (sum2 - sum * mean) / (k - 1);
+        double fpc = 1.0 - (double)k / nblocks;
+
+        if (var < 0)
+            var = 0;
+
+        // The correction: the ratio of the real to the sampled sizes, and its variance.
+
+        size_t c = real.size();
+        double rsum = 0;
+        double ssum = 0;
+
+        for (size_t j = 0; j < c; ++j) {
+            rsum += real[j];
+            ssum += sampled[j];
+        }
+
+        double ratio = (ssum > 0 ? rsum / ssum : 1.0);
+        double rvar = 0;
+
+        for (size_t j = 0; j < c; ++j) {
+            double d = real[j] - ratio * sampled[j];
+            rvar += d * d;
+        }
+
+        if (ssum > 0)
+            rvar = rvar / (c - 1) / c / ((ssum / c) * (ssum / c));
+
+        count_writer_t header;
+        header.vlq(n);
+
+        double size = ratio * mean * n;
+        double sizevar = (ratio * ratio * var / k * fpc + mean * mean * rvar) * n * n;
+
+        // The ratio is measured at the start of the input and can drift further on,
+        // so the correction itself counts as possible bias. Per-block differences
+        // that neither variance sees (where the blocks are cut) come to a few bytes
+        // per block.
+
+        double drift = fabs(1.0 - ratio) * mean * n;
+
+        ret.size = header.size + (size_t)(size + 0.5);
+        ret.error = (size_t)(1.96 * sqrt(sizevar) + drift + 0.5) + ESTIMATE_SLACK * nblocks;
+
+        return ret;
+    }
+
+    estimate_t estimate_compressed_size(const std::string& s, size_t sampling = 1) {
+
+        const unsigned char* i = (const unsigned char*)s.data();
+        const unsigned char* e = i + s.size();
+        return estimate_compressed_size(i, e, sampling);
+    }
+
+    // Compress [i, e); the data in [i0, i) is history that may be referenced but is not output.
+
+    void encode(const unsigned char* i0, const unsigned char* i, const unsigned char* e, std::string& ret) {
+
+        if (nthreads > 0 && throughput == 0) {
+            parallel_encode(i0, i, e, ret);
+            return;
+        }
+
+        string_writer_t w(ret);
+        parse(i0, i, e, w);
+    }
+
+    /*
+     * Parallel mode: a window of 2^PARALLEL_WINDOW_BITS positions at a time, each
+     * position is linked to the previous position with the same prefix hash, then
+     * 'nthreads' threads find the best match for disjoint ranges of the window by
+     * walking those links (which they only read), and one thread writes the tokens
+     * from the matches found.
+     *
+     * Like the serial parse, the threads search only where a match can start:
+     * inside a match, a position gets the rest of the same match instead. (With
+     * lazy matching, the position after the start of a match is searched too.)
+     * Every MATCH_ANCHOR'th position is searched regardless and the ranges start
+     * at those, so the output doesn't depend on the number of threads.
+     *
+     * The links cover every position, not only the ones the serial parse visits,
+     * so the output is usually smaller than the serial one at the same level, but
+     * matches can't reach back further than 2^PARALLEL_WINDOW_BITS bytes. The links
+     * are slower to walk than the buckets: one thread takes about twice as long as
+     * the serial parse, so it takes three or more threads to be faster.
+     *
+     * Pass 0 to turn it off. Inputs can be at most 4 gigabytes.
+     */
+
+    void set_threads(size_t n) {
+        nthreads = n;
+    }
+
+    // The best matches for the positions in [a, b) into runs[] and offs[], which start at 'a'.
+    // 'a' must be at a multiple of MATCH_ANCHOR from the start of the frame. 'prev' is a ring
+    // of links (see parallel_encode()); matches are at most 2^PARALLEL_WINDOW_BITS bytes back.
+
+    static void find_matches(const unsigned char* i0, const unsigned char* a, const unsigned char* b, const unsigned char* e,
+                             const uint32_t* prev, size_t mask, size_t depth, bool lazy, uint32_t* runs, uint32_t* offs) {
+
+        const size_t window = (size_t)1 << PARALLEL_WINDOW_BITS;
+
+        // The rest of the last match found, which the following positions get.
+        size_t last = 0;
+        size_t lastoff = 0;
+
+        // Whether this position is the one after the start of that match.
+        bool started = false;
+
+        for (const unsigned char* p = a; p < b && p <= e - MIN_RUN; ++p) {
+
+            size_t k = p - a;
+            size_t here = p - i0;
+
+            if (k % MATCH_ANCHOR == 0) {
+                last = 0;
+                started = false;
+            }
+
+            if (last > 1 && !started) {
+                --last;
+                runs[k] = last;
+                offs[k] = lastoff;
+                continue;
+            }
+
+            size_t maxrun = 0;
+            size_t maxoffset = 0;
+            size_t maxgain = 0;
+
+            // Matches are only compared up to MATCH_ANCHOR bytes; the parse extends them.
+            const unsigned char* f = (e - p > MATCH_ANCHOR ? p + MATCH_ANCHOR : e);
+
+            size_t next = prev[here & mask];
+
+            for (size_t n = depth; n > 0 && next != 0; --n) {
+
+                size_t pos = next - 1;
+
+                if (here - pos > window)
+                    break;
+
+                next = prev[pos & mask];
+
+                // Later candidates are further away, so they are only better if they are longer.
+                if (maxrun > 0 && (p + maxrun == f || i0[pos + maxrun] != p[maxrun]))
+                    continue;
+
+                size_t run = repeat_run(p, f, here - pos);
+                size_t gain = gains(run, here - pos);
+
+                if (gain > maxgain) {
+                    maxrun = run;
+                    maxoffset = here - pos;
+                    maxgain = gain;
+                }
+            }
+
+            runs[k] = maxrun;
+            offs[k] = maxoffset;
+
+            // (The search for lazy matching doesn't start a match of its own.)
+            if (started) {
+                started = false;
+
+                if (last > 0)
+                    --last;
+
+            } else {
+                last = maxrun;
+                lastoff = maxoffset;
+                started = (lazy && maxrun >= MIN_RUN);
+            }
+        }
+    }
+
+    void parallel_encode(const unsigned char* i0, const unsigned char* i, const unsigned char* e, std::string& ret) {
+
+        size_t n = e - i;
+
+        if ((size_t)(e - i0) > 0xFFFFFFFF)
+            throw std::length_error("Input too large for parallel mode");
+
+        string_writer_t w(ret);
+        w.vlq(n);
+
+        if (n < MIN_RUN) {
+
+            if (n > 0)
+                write_literals(w, i, n);
+
+            return;
+        }
+
+        // The links: prev[p & mask] is the previous position with the same hash as p,
+        // plus 1, for the current window and the one before it. (Smaller inputs
+        // need a smaller ring.)
+
+        const size_t window = (size_t)1 << PARALLEL_WINDOW_BITS;
+
+        size_t ring = 2 * window;
+
+        while (ring / 2 >= (size_t)(e - i0))
+            ring = ring / 2;
+
+        size_t blocksize = offsets.blocksize;
+        std::vector<uint32_t> head(blocksize);
+        std::vector<uint32_t> prev(ring);
+        size_t mask = ring - 1;
+
+        std::vector<uint32_t> runs(n < window ? n : window);
+        std::vector<uint32_t> offs(n < window ? n : window);
+        size_t depth = (chained ? chains.depth : offsets.depth);
+
+        const unsigned char* h = (i - i0 > (ptrdiff_t)window ? i - window : i0);
+        const unsigned char* unc = i;
+        const unsigned char* p = i;
+
+        for (const unsigned char* c = i; c < e; c += window) {
+
+            const unsigned char* ce = (e - c > (ptrdiff_t)window ? c + window : e);
+
+            for (; h < ce && h <= e - MIN_RUN; ++h) {
+                uint16_t packed = HASH::hash(h) % blocksize;
+                prev[(h - i0) & mask] = head[packed];
+                head[packed] = h - i0 + 1;
+            }
+
+            // (A long match can cover the whole window.)
+            if (p >= ce)
+                continue;
+
+            std::vector<std::thread> threads;
+            size_t anchors = (ce - c + MATCH_ANCHOR - 1) / MATCH_ANCHOR;
+
+            for (size_t t = 0; t < nthreads; ++t) {
+
+                const unsigned char* a = c + anchors * t / nthreads * MATCH_ANCHOR;
+                const unsigned char* b = c + anchors * (t + 1) / nthreads * MATCH_ANCHOR;
+
+                if (b > ce)
+                    b = ce;
+
+                if (a >= b)
+                    continue;
+
+                threads.push_back(std::thread(find_matches, i0, a, b, e, prev.data(), mask, depth, lazy,
+                                              runs.data() + (a - c), offs.data() + (a - c)));
+            }
+
+            for (size_t t = 0; t < threads.size(); ++t)
+                threads[t].join();
+
+            while (p < ce && p <= e - MIN_RUN) {
+
+                size_t k = p - c;
+
+                if (runs[k] < MIN_RUN) {
+                    ++p;
+                    continue;
+                }
+
+                // (Not across windows: the next window's matches aren't there yet.)
+                if (lazy && p + 1 < ce && p + 1 <= e - MIN_RUN && runs[k + 1] >= MIN_RUN &&
+                    gains(runs[k + 1], offs[k + 1]) > gains(runs[k], offs[k])) {
+                    ++p;
+                    ++k;
+                }
+
+                size_t run = runs[k];
+
+                if (run == MATCH_ANCHOR)
+                    run += repeat_run(p + run, e, offs[k]);
+
+                if (p != unc)
+                    write_literals(w, unc, p - unc);
+
+                write_match(w, run, offs[k]);
+
+                p += run;
+                unc = p;
+            }
+        }
+
+        if (unc != e)
+            write_literals(w, unc, e - unc);
+    }
+
+    template <typename WRITER>
+    bool parse(const unsigned char* i0, const unsigned char* i, const unsigned char* e, WRITER& w) {
+
+        if (!w.vlq(e - i))
+            return false;
+
+        if (chained && (size_t)(e - i0) > 0xFFFFFFFF)
+            throw std::length_error("Input too large for hash chains");
+
+        index_clear();
+
+        size_t blocksize = offsets.blocksize;
+
+        for (const unsigned char* h = i0; h < i && h <= e - MIN_RUN; ++h) {
+
+            uint16_t packed;
+            packed = HASH::hash(h) % blocksize;
+            index_insert(packed, h - i0);
+        }
+
+        return tokens(i0, i, e, w);
+    }
+
+    // Write the tokens for [i, e), without the size header.
+
+    template <typename WRITER>
+    bool tokens(const unsigned char* i0, const unsigned char* i, const unsigned char* e, WRITER& w) {
+
+        size_t blocksize = offsets.blocksize;
+
+        // Start of the pending packet of uncompressed data.
+        const unsigned char* unc = i;
+
+        // Positions without a match since the last match.
+        size_t misses = 0;
+
+        const unsigned char* start = i;
+        const unsigned char* check = e;
+
+        if (throughput > 0) {
+            pace_start(e - i);
+            check = i + PACE_BLOCKSIZE;
+        }
+
+        while (i != e) {
+
+            if (i >= check) {
+                pace_step(i - start);
+                check = i + PACE_BLOCKSIZE;
+            }
+
+            // The last MIN_RUN-1 bytes are uncompressable. (At least MIN_RUN bytes
+            // are needed to calculate a prefix hash.)
+
+            if (i > e - MIN_RUN) {
+                i = e;
+                break;
+            }
+
+            size_t maxrun = 0;
+            size_t maxoffset = 0;
+            size_t maxgain = 0;
+
+            // Runs of a byte (or of a 2- or 4-byte pattern), e.g. zero padding, are
+            // matched directly at a short offset, without hashing or probing every
+            // position in them; only the last few positions go into the table.
+
+            for (size_t period = 1; period <= 4; period *= 2) {
+
+                if (i - i0 < (ptrdiff_t)period || *i != *(i - period))
+                    continue;
+
+                maxrun = repeat_run(i, e, period);
+
+                if (maxrun < REPEAT_MIN) {
+                    maxrun = 0;
+                    continue;
+                }
+
+                if (i != unc && !write_literals(w, unc, i - unc))
+                    return false;
+
+                if (!write_match(w, maxrun, period))
+                    return false;
+
+                i += maxrun;
+                unc = i;
+                misses = 0;
+
+                for (const unsigned char* h = i - REPEAT_INSERT; h < i && h <= e - MIN_RUN; ++h)
+                    index_insert(HASH::hash(h) % blocksize, h - i0);
+
+                break;
+            }
+
+            if (maxrun > 0)
+                continue;
+
+            uint16_t packed;
+
+            // The MIN_RUN prefix length was chosen empirically, based on a series
+            // of unscientific tests.
+
+            packed = HASH::hash(i) % blocksize;
+
+            find(packed, i0, i, e, maxrun, maxoffset, maxgain);
+
+            if (maxrun < MIN_RUN) {
+
+                if (accel) {
+                    i += 1 + (misses >> accel);
+                    ++misses;
+
+                    if (i > e)
+                        i = e;
+
+                } else {
+                    ++i;
+                }
+
+                continue;
+            }
+
+            if (lazy && i + 1 <= e - MIN_RUN) {
+
+                // Take the match one byte ahead instead, if it's better.
+
+                size_t run = 0;
+                size_t offset = 0;
+                size_t gain = 0;
+
+                packed = HASH::hash(i + 1) % blocksize;
+
+                find(packed, i0, i + 1, e, run, offset, gain);
+
+                if (gain > maxgain) {
+                    ++i;
+                    maxrun = run;
+                    maxoffset = offset;
+                }
+            }
+
+            misses = 0;
+
+            if (i != unc && !write_literals(w, unc, i - unc))
+                return false;
+
+            if (!write_match(w, maxrun, maxoffset))
+                return false;
+
+            i += maxrun;
+            unc = i;
+        }
+
+        if (i != unc && !write_literals(w, unc, i - unc))
+            return false;
+
+        return true;
+    }
+};
+
+typedef basic_compress_t<> compress_t;
+
+/*
+ * The fastest compressor, for when speed matters much more than ratio.
+ *
+ * A direct-mapped table of 32-bit positions, one candidate per hash value;
+ * the candidate is verified against the data before it's used. After a long
+ * stretch without matches the compressor skips positions faster and faster.
+ *
+ * The table is not cleared between calls: positions are counted from the
+ * start of the first call, so entries left over from previous inputs are out
+ * of range and ignored. (The table is cleared only when the count would
+ * overflow 32 bits.)
+ *
+ * The output is in the usual format. Inputs can be at most 2 gigabytes.
+ */
+
+template <size_t HASH_BITS = 16>
+struct fast_compress_t {
+
+    std::vector<uint32_t> table;
+
+    // Position of the current input's first byte.
+    size_t base;
+
+    fast_compress_t() : table(1 << HASH_BITS), base(0) {}
+
+    static size_t hash(const unsigned char* i) {
+
+        uint32_t v;
+        ::memcpy(&v, i, sizeof(v));
+
+        return (v * (uint32_t)2654435761U) >> (32 - HASH_BITS);
+    }
+
+    std::string feed(const unsigned char* i, const unsigned char* e) {
+
+        size_t n = e - i;
+
+        if (n > 0x7FFFFFFF)
+            throw std::length_error("Input too large");
+
+        if (base + n > 0xFFFFFFFF) {
+            table.assign(table.size(), 0);
+            base = 0;
+        }
+
+        std::string ret;
+        ret.reserve(n / 2);
+
+        string_writer_t w(ret);
+        w.vlq(n);
+
+        const unsigned char* b = i;
+        const unsigned char* unc = i;
+        size_t misses = 0;
+
+        while (e - i >= MIN_RUN) {
+
+            uint32_t& slot = table[hash(i)];
+            size_t cand = slot;
+            size_t pos = base + (i - b);
+            slot = pos;
+
+            if (cand >= base && cand < pos) {
+
+                const unsigned char* c = b + (cand - base);
+
+                if (::memcmp(c, i, 4) == 0) {
+
+                    size_t offset = i - c;
+                    size_t run = 4 + repeat_run(i + 4, e, offset);
+
+                    if (run >= MIN_RUN && gains(run, offset) > 0) {
+
+                        if (i != unc)
+                            write_literals(w, unc, i - unc);
+
+                        write_match(w, run, offset);
+
+                        i += run;
+                        unc = i;
+                        misses = 0;
+
+                        // Also index a position inside the match, for the next one.
+                        if (e - i >= MIN_RUN)
+                            table[hash(i - 2)] = base + (i - 2 - b);
+
+                        continue;
+                    }
+                }
+            }
+
+            size_t step = 1 + (misses >> 6);
+            ++misses;
+
+            if ((size_t)(e - i) <= step)
+                break;
+
+            i += step;
+        }
+
+        if (unc != e)
+            write_literals(w, unc, e - unc);
+
+        base += n;
+
+        return ret;
+    }
+
+    std::string feed(const std::string& s) {
+
+        const unsigned char* i = (const unsigned char*)s.data();
+        const unsigned char* e = i + s.size();
+        return feed(i, e);
+    }
+};
+
+/*
+ * Compression for small pages, e.g. the 4 or 16 kilobyte pages of a storage engine.
+ *
+ * The hash table is a small array of 16-bit positions inside the object, so a
+ * page_compress_t can live on the stack. It is cleared for every page (8 kilobytes
+ * by default, much less than compressing the page), so every candidate is behind
+ * the current position and can be read without checks.
+ * There is one candidate per hash value, checked with one word compare; after a long
+ * stretch without matches the compressor starts skipping positions.
+ *
+ * 'feed' writes into a fixed-size output slot and returns the compressed size,
+ * or 0 as soon as it's clear that the output doesn't fit.
+ *
+ * The output is in the usual format, so decompress_t can decode it; use
+ * decompress_page() to decode straight into a page frame.
+ *
+ * Pages can be at most 64 kilobytes.
+ */
+
+template <size_t HASH_BITS = 12>
+struct page_compress_t {
+
+    uint16_t table[1 << HASH_BITS];
+
+    // Hashes the first MIN_RUN bytes of a word.
+    static size_t hash(uint64_t v) {
+
+        return ((v << 24) * (uint64_t)889523592379ULL) >> (64 - HASH_BITS);
+    }
+
+    // Selects the first MIN_RUN bytes of a word, whatever the byte order.
+    static uint64_t head_mask() {
+
+        static const unsigned char bytes[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0 };
+        uint64_t m;
+        ::memcpy(&m, bytes, 8);
+        return m;
+    }
+
+    static uint64_t word(const unsigned char* i) {
+
+        uint64_t v;
+        ::memcpy(&v, i, sizeof(v));
+        return v;
+    }
+
+    size_t feed(const unsigned char* i, const unsigned char* e, unsigned char* out, unsigned char* oute) {
+
+        if (e - i > 0x10000)
+            throw std::length_error("Page too large");
+
+        buffer_writer_t w(out, oute);
+
+        if (!w.vlq(e - i))
+            return 0;
+
+        ::memset(table, 0, sizeof(table));
+
+        const unsigned char* i0 = i;
+        const unsigned char* unc = i;
+        size_t misses = 0;
+
+        while (e - i >= 8) {
+
+            uint64_t v = word(i);
+            uint16_t& slot = table[hash(v)];
+            size_t pos = slot;
+            slot = i - i0;
+
+            size_t run = 0;
+            size_t offset = i - i0 - pos;
+
+            // Compares a whole word without branches; matches are extended a word at a time.
+            if (((word(i0 + pos) ^ v) & head_mask()) == 0 && pos < (size_t)(i - i0))
+                run = MIN_RUN + repeat_run(i + MIN_RUN, e, offset);
+
+            if (run == 0) {
+                i += 1 + (misses >> 6);
+                ++misses;
+                continue;
+            }
+
+            if (i != unc && !write_literals(w, unc, i - unc))
+                return 0;
+
+            if (!write_match(w, run, offset))
+                return 0;
+
+            i += run;
+            unc = i;
+            misses = 0;
+
+            if (e - i >= 8)
+                table[hash(word(i - 2))] = i - 2 - i0;
+        }
+
+        if (unc != e && !write_literals(w, unc, e - unc))
+            return 0;
+
+        return w.out - out;
+    }
+
+    size_t feed(const std::string& s, unsigned char* out, unsigned char* oute) {
+
+        const unsigned char* i = (const unsigned char*)s.data();
+        const unsigned char* e = i + s.size();
+        return feed(i, e, out, oute);
+    }
+};
+
+/*
+ * Decoder statistics: what the decoded data is made of, for finding out why
+ * some inputs decode slower than others. Collected only when
+ * decompress_t::collect_stats is set.
+ */
+
+struct decode_stats_t {
+
+    enum {
+        OFFSET_CLASSES = 64
+    };
+
+    uint64_t literal_tokens;
+    uint64_t match_tokens;
+    uint64_t literal_bytes;
+    uint64_t match_bytes;
+
+    // How the match bytes were copied: with memcpy, with the byte loop
+    // (the match overlaps its own output, i.e. offset < length), or from
+    // the history of previous frames.
+    uint64_t memcpy_bytes;
+    uint64_t overlap_bytes;
+    uint64_t history_bytes;
+
+    // Matches by the bit length of their offset: offsets[n] counts offsets
+    // in [2^(n-1), 2^n).
+    uint64_t offsets[OFFSET_CLASSES];
+
+    // Calls to 'feed' that ran out of input in the middle of a VLQ number
+    // or of a literal, and calls that ran out between tokens.
+    uint64_t partial_vlqs;
+    uint64_t partial_literals;
+    uint64_t partial_tokens;
+
+    decode_stats_t() {
+        clear();
+    }
+
+    void clear() {
+        ::memset(this, 0, sizeof(*this));
+    }
+
+    void add_offset(size_t off) {
+
+        size_t n = 0;
+
+        while (off > 0) {
+            off >>= 1;
+            ++n;
+        }
+
+        ++offsets[n];
+    }
+};
+
+/*
+ * Entry point for decompression.
+ * Calling 'feed' and 'result' out of order is undefined behaviour 
+ * and will crash your program.
+ */
+
+struct decompress_t {
+
+    size_t max_size;
+    size_t window;
+    std::string history;
+    std::string ret;
+    unsigned char* out;
+    unsigned char* outb;
+    unsigned char* oute;
+
+    // Optional: where to put the uncompressed data, e.g. a memory-mapped file.
+    // Called with the size of each frame; must return a buffer of at least
+    // that size, which has to stay valid until the frame is finished.
+    // ('result()' is empty when this is used.)
+    unsigned char* (*alloc)(void* ctx, size_t size);
+    void* alloc_ctx;
+
+    // Optional: set to count tokens and copies into 'stats'. (A separate
+    // instantiation of the decoder, so there is no cost when it's off.)
+    bool collect_stats;
+    decode_stats_t stats;
+
+    struct state_t {
+        size_t msg;
+        size_t run;
+        size_t vlq_num;
+        size_t vlq_off;
+        enum {
+            INIT,
+            START,
+            READ_DATA,
+            READ_RUN,
+            READ_TRAILER,
+            READ_TRAILER_END
+        } state;
+
+        // Whether the frame is an append-mode frame, which ends in a trailer.
+        bool trailer;
+
+        state_t() : msg(0), run(0), vlq_num(0), vlq_off(0), state(INIT), trailer(false) {}
+    };
+
+    state_t state;
+
+    // Utility function: decode variable-length-coded unsigned integers.
+
+    bool pop_vlq_uint(const unsigned char*& i, const unsigned char* e, size_t& res) {
+
+        while (1) {
+
+            if (i == e)
+                return false;
+
+            size_t c = *i;
+
+            if ((c & 0x80) == 0) {
                 state.vlq_num |= (c << state.vlq_off);
                 break;
             }
@@ -494,9 +2260,65 @@ struct decompress_t {
      * paranoid about accepting data from unknown sources.
      *
      * The default of 0 means no sanity checking is done.
+     *
+     * window is for decoding frames made by a compress_t in append mode;
+     * it must be the same as the compressor's window.
      */
 
-    decompress_t(size_t _max_size = 0) : max_size(_max_size), out(NULL), outb(NULL), oute(NULL) {}
+    decompress_t(size_t _max_size = 0, size_t _window = 0) :
+        max_size(_max_size), window(_window), out(NULL), outb(NULL), oute(NULL), alloc(NULL), alloc_ctx(NULL),
+        collect_stats(false) {}
+
+    // Append mode: remember the tail of a finished frame for the frames that follow.
+
+    void push_history() {
+
+        if (window == 0)
+            return;
+
+        size_t size = oute - outb;
+
+        if (size >= window) {
+            history.assign(oute - window, oute);
+
+        } else {
+            history.append(outb, oute);
+
+            if (history.size() > window)
+                history.erase(0, history.size() - window);
+        }
+    }
+
+    // Append mode: read the trailer of a frame whose data is complete.
+
+    template <bool CHECKED>
+    bool pop_trailer(const unsigned char*& i, const unsigned char* e) {
+
+        if (state.state != state_t::READ_TRAILER_END) {
+
+            state.state = state_t::READ_TRAILER;
+
+            if (!pop_vlq_uint(i, e, state.run))
+                return false;
+
+            ++i;
+            state.state = state_t::READ_TRAILER_END;
+        }
+
+        if (i == e)
+            return false;
+
+        if (CHECKED) {
+            count_writer_t w;
+            w.vlq(state.run);
+
+            if (*i != w.size)
+                throw std::runtime_error("Malformed data while uncompressing");
+        }
+
+        ++i;
+        return true;
+    }
 
     /*
      * Inputs: the compressed string, as output from 'compress()'.
@@ -517,6 +2339,40 @@ struct decompress_t {
     }
 
     bool feed(const unsigned char* i, const unsigned char* e, std::string& remaining) {
+        call_timer_t<LZ77_METRICS> _t(metrics_t::DECOMPRESS, e - i);
+
+        if (collect_stats)
+            return feed_impl<true, true>(i, e, remaining);
+
+        return feed_impl<true, false>(i, e, remaining);
+    }
+
+    /*
+     * The same as 'feed', but for trusted data only, e.g. data that your own system
+     * wrote and has verified with a checksum: the tokens aren't validated, so
+     * malformed input is undefined behaviour instead of an exception.
+     * (The frame size is still checked against 'max_size'.)
+     */
+
+    bool feed_trusted(const std::string& s, std::string& remaining) {
+
+        const unsigned char* i = (const unsigned char*)s.data();
+        const unsigned char* e = i + s.size();
+
+        return feed_trusted(i, e, remaining);
+    }
+
+    bool feed_trusted(const unsigned char* i, const unsigned char* e, std::string& remaining) {
+        call_timer_t<LZ77_METRICS> _t(metrics_t::DECOMPRESS, e - i);
+
+        if (collect_stats)
+            return feed_impl<false, true>(i, e, remaining);
+
+        return feed_impl<false, false>(i, e, remaining);
+    }
+
+    template <bool CHECKED, bool STATS>
+    bool feed_impl(const unsigned char* i, const unsigned char* e, std::string& remaining) {
 
         // This function is complex because it is streamable and robust.
         // The routine checks if the input isn't complete and will properly
@@ -526,20 +2382,36 @@ struct decompress_t {
 
             ret.clear();
 
+            const unsigned char* b = i;
+            size_t off = state.vlq_off;
+
+            // (True for no input at all; false for a partial size, which is kept.)
             size_t size;
             if (!pop_vlq_uint(i, e, size))
-                return true;
+                return (state.vlq_off == 0);
+
+            // An append-mode frame: the size ends in an empty group.
+            bool trailer = (*i == 0 && (i > b ? (i[-1] & 0x80) != 0 : off > 0));
 
             ++i;
 
             state = state_t();
+            state.trailer = trailer;
+
+            if (trailer && window == 0)
+                throw std::runtime_error("Append-mode frame; it needs a decompress_t with a window");
 
             if (max_size && size > max_size)
                 throw std::length_error("Uncompressed data in message deemed too large");
 
-            ret.resize(size);
+            if (alloc) {
+                outb = alloc(alloc_ctx, size);
+
+            } else {
+                ret.resize(size);
+                outb = (unsigned char*)ret.data();
+            }
 
-            outb = (unsigned char*)ret.data();
             oute = outb + size;
             out = outb;
 
@@ -549,32 +2421,50 @@ struct decompress_t {
         while (i != e) {
 
             if (out == oute) {
+
+                if (state.trailer && !pop_trailer<CHECKED>(i, e))
+                    return false;
+
                 remaining.assign(i, e);
                 state.state = state_t::INIT;
+                push_history();
                 return true;
             }
 
             if (state.state == state_t::START) {
 
-                if (!pop_vlq_uint(i, e, state.msg))
+                if (!pop_vlq_uint(i, e, state.msg)) {
+
+                    if (STATS)
+                        ++stats.partial_vlqs;
+
                     return false;
+                }
 
                 ++i;
 
                 state.state = ((state.msg & 1) ? state_t::READ_DATA : state_t::READ_RUN);
 
                 state.msg = state.msg >> 1;
+
+                if (STATS && state.state == state_t::READ_DATA)
+                    ++stats.literal_tokens;
             }
 
             if (state.state == state_t::READ_DATA) {
 
                 size_t len = state.msg;
                 
-                if (out + len > oute)
+                if (CHECKED && out + len > oute)
                     throw std::runtime_error("Malformed data while uncompressing");
 
-                if (i == e)
+                if (i == e) {
+
+                    if (STATS)
+                        ++stats.partial_literals;
+
                     return false;
+                }
 
                 if (i + len > e) {
 
@@ -583,6 +2473,11 @@ struct decompress_t {
                     out += l;
                     state.msg -= l;
 
+                    if (STATS) {
+                        stats.literal_bytes += l;
+                        ++stats.partial_literals;
+                    }
+
                     return false;
                 }
 
@@ -590,6 +2485,9 @@ struct decompress_t {
                 out += len;
                 i += len;
 
+                if (STATS)
+                    stats.literal_bytes += len;
+
                 state.state = state_t::START;
 
             } else if (state.state == state_t::READ_RUN) {
@@ -602,8 +2500,13 @@ struct decompress_t {
 
                 } else {
 
-                    if (!pop_vlq_uint(i, e, state.run))
+                    if (!pop_vlq_uint(i, e, state.run)) {
+
+                        if (STATS)
+                            ++stats.partial_vlqs;
+
                         return false;
+                    }
 
                     ++i;
                 }
@@ -611,17 +2514,47 @@ struct decompress_t {
                 size_t off = (state.msg >> SHORTRUN_BITS);
                 size_t run = state.run + MIN_RUN - 1;
 
-                unsigned char* outi = out - off;
+                if (STATS) {
+                    ++stats.match_tokens;
+                    stats.match_bytes += run;
+                    stats.add_offset(off);
+                }
 
-                if (outi >= oute || outi < outb || out + run > oute || out + run < out)
+                if (CHECKED && (out + run > oute || out + run < out))
                     throw std::runtime_error("Malformed data while uncompressing");
 
+                if (off > (size_t)(out - outb)) {
+
+                    // The string starts in a previous frame. (Only possible in append mode.)
+
+                    size_t back = off - (out - outb);
+
+                    if (CHECKED && back > history.size())
+                        throw std::runtime_error("Malformed data while uncompressing");
+
+                    size_t l = (back < run ? back : run);
+                    ::memcpy(out, history.data() + history.size() - back, l);
+                    out += l;
+                    run -= l;
+
+                    if (STATS)
+                        stats.history_bytes += l;
+                }
+
+                unsigned char* outi = out - off;
+
                 if (outi + run < out) {
                     ::memcpy(out, outi, run);
                     out += run;
 
+                    if (STATS)
+                        stats.memcpy_bytes += run;
+
                 } else {
 
+                    if (STATS)
+                        stats.overlap_bytes += run;
+
                     while (run > 0) {
                         *out = *outi;
                         ++out;
@@ -634,12 +2567,16 @@ struct decompress_t {
             }
         }
 
-        if (out == oute) {
+        if (out == oute && !state.trailer) {
             remaining.assign(i, e);
             state.state = state_t::INIT;
+            push_history();
             return true;
         }
 
+        if (STATS && state.state == state_t::START)
+            ++stats.partial_tokens;
+
         return false;
     }
 
@@ -653,6 +2590,423 @@ struct decompress_t {
 
 };
 
+/*
+ * Compressed data embedded in a program, as written by 'yalz -e NAME'.
+ * The data is decompressed when 'get' is first called; threads that call it
+ * at the same time wait for that one decompression.
+ */
+
+struct asset_t {
+
+    const unsigned char* data;
+    size_t size;
+    std::once_flag once;
+    std::string ret;
+
+    asset_t(const unsigned char* d, size_t s) : data(d), size(s) {}
+
+    const std::string& get() {
+
+        std::call_once(once, [this]() { decode(); });
+        return ret;
+    }
+
+    void decode() {
+
+        decompress_t decompress;
+        std::string buff((const char*)data, size);
+        std::string extra;
+
+        while (buff.size() > 0) {
+
+            if (!decompress.feed(buff, extra))
+                throw std::runtime_error("Truncated compressed data");
+
+            ret += decompress.result();
+            buff.swap(extra);
+        }
+    }
+};
+
+/*
+ * Decode one whole frame directly into a caller's buffer, such as a page frame.
+ *
+ * 'i' is moved to the end of the frame. Returns the uncompressed size.
+ * Throws if the frame is malformed or incomplete, or if it doesn't fit in [out, oute).
+ */
+
+inline size_t decompress_page(const unsigned char*& i, const unsigned char* e,
+                              unsigned char* out, unsigned char* oute) {
+
+    size_t size;
+
+    if (!read_vlq_uint(i, e, size))
+        throw std::runtime_error("Malformed data while uncompressing");
+
+    if (size > (size_t)(oute - out))
+        throw std::length_error("Uncompressed data doesn't fit in the page");
+
+    unsigned char* outb = out;
+    oute = out + size;
+
+    while (out != oute) {
+
+        size_t msg;
+
+        // Most tokens are one byte.
+        if (i != e && *i < 0x80) {
+            msg = *i;
+            ++i;
+
+        } else if (!read_vlq_uint(i, e, msg)) {
+            throw std::runtime_error("Malformed data while uncompressing");
+        }
+
+        if (msg & 1) {
+
+            size_t len = msg >> 1;
+
+            if (len > (size_t)(oute - out) || len > (size_t)(e - i))
+                throw std::runtime_error("Malformed data while uncompressing");
+
+            // Short literals: copy two whole words if there's room on both sides.
+            if (len <= 16 && oute - out >= 16 && e - i >= 16) {
+                ::memcpy(out, i, 8);
+                ::memcpy(out + 8, i + 8, 8);
+            } else {
+                ::memcpy(out, i, len);
+            }
+
+            out += len;
+            i += len;
+
+        } else {
+
+            msg = msg >> 1;
+
+            size_t run = msg & (SHORTRUN_MAX - 1);
+
+            if (run == 0 && !read_vlq_uint(i, e, run))
+                throw std::runtime_error("Malformed data while uncompressing");
+
+            size_t off = (msg >> SHORTRUN_BITS);
+            run = run + MIN_RUN - 1;
+
+            if (run > (size_t)(oute - out) || off > (size_t)(out - outb) || off == 0)
+                throw std::runtime_error("Malformed data while uncompressing");
+
+            unsigned char* outi = out - off;
+            unsigned char* stop = out + run;
+
+            // Most matches are short: two whole words, which may spill over bytes
+            // that are written later.
+            if (off >= 8 && run <= 16 && oute - out >= 16) {
+                ::memcpy(out, outi, 8);
+                ::memcpy(out + 8, outi + 8, 8);
+                out = stop;
+                continue;
+            }
+
+            // Otherwise a word at a time while a whole word fits in the page. A period
+            // shorter than a word is spelled out once, and after that is copied from
+            // the first multiple of the period that is at least a word back.
+            size_t back = off;
+
+            if (off < 8 && oute - out >= 8) {
+
+                for (size_t k = 0; k < 8; ++k)
+                    out[k] = outi[k];
+
+                while (back < 8)
+                    back += off;
+
+                out += 8;
+            }
+
+            if (back >= 8) {
+
+                while (out < stop && oute - out >= 8) {
+                    ::memcpy(out, out - back, 8);
+                    out += 8;
+                }
+            }
+
+            while (out < stop) {
+                *out = *(out - back);
+                ++out;
+            }
+
+            out = stop;
+        }
+    }
+
+    return size;
+}
+
+/*
+ * Whether the frame that starts at 'i' was made in append mode, i.e. needs a
+ * decompress_t with a window. (See basic_compress_t; false if [i, e) ends
+ * before the frame size does.)
+ */
+
+inline bool append_frame(const unsigned char* i, const unsigned char* e) {
+
+    for (; i != e; ++i) {
+        if ((*i & 0x80) == 0)
+            return false;
+
+        if (i + 1 != e && i[1] == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Find the end of the compressed frame that starts at 'i' without decoding it.
+ * The frame's structure is checked on the way.
+ *
+ * Returns the end of the frame, or NULL if [i, e) ends before the frame does.
+ * 'size' is set to the uncompressed size.
+ * Throws if the frame is malformed.
+ *
+ * Frames made in append mode are rejected; see append_frame().
+ */
+
+inline const unsigned char* skip_frame(const unsigned char* i, const unsigned char* e, size_t& size) {
+
+    if (append_frame(i, e))
+        throw std::runtime_error("Append-mode frame; it needs a decompress_t with a window");
+
+    if (!read_vlq_uint(i, e, size))
+        return NULL;
+
+    size_t pos = 0;
+
+    while (pos != size) {
+
+        size_t msg;
+
+        if (!read_vlq_uint(i, e, msg))
+            return NULL;
+
+        if (msg & 1) {
+
+            size_t len = msg >> 1;
+
+            if (len > size - pos)
+                throw std::runtime_error("Malformed data while uncompressing");
+
+            if (len > (size_t)(e - i))
+                return NULL;
+
+            i += len;
+            pos += len;
+
+        } else {
+
+            msg = msg >> 1;
+
+            size_t run = msg & (SHORTRUN_MAX - 1);
+
+            if (run == 0 && !read_vlq_uint(i, e, run))
+                return NULL;
+
+            size_t off = (msg >> SHORTRUN_BITS);
+            run = run + MIN_RUN - 1;
+
+            if (run > size - pos || off > pos)
+                throw std::runtime_error("Malformed data while uncompressing");
+
+            pos += run;
+        }
+    }
+
+    return i;
+}
+
+/*
+ * Similarity sketches, for putting similar inputs next to each other before
+ * compressing them together (e.g. in a solid block), so the compressor finds
+ * more matches within its reach.
+ *
+ * A sketch is a one-permutation MinHash: every 8-byte string of the input is
+ * hashed, the top bits of the hash pick one of SKETCH_SIZE bins, and each bin
+ * keeps the smallest hash it saw. The share of equal bins between two sketches
+ * estimates how many strings the inputs have in common.
+ */
+
+enum {
+    SKETCH_SIZE = 32,
+    SKETCH_BANDS = 8
+};
+
+struct sketch_t {
+    uint32_t mins[SKETCH_SIZE];
+};
+
+inline void make_sketch(const unsigned char* i, const unsigned char* e, sketch_t& sketch) {
+
+    for (size_t n = 0; n < SKETCH_SIZE; ++n)
+        sketch.mins[n] = 0xFFFFFFFF;
+
+    while (e - i >= 8) {
+
+        uint64_t v;
+        ::memcpy(&v, i, 8);
+
+        uint64_t h = v * (uint64_t)0x9E3779B97F4A7C15ULL;
+
+        size_t bin = h >> 59;
+        uint32_t val = (uint32_t)(h >> 16);
+
+        if (val < sketch.mins[bin])
+            sketch.mins[bin] = val;
+
+        ++i;
+    }
+}
+
+inline size_t sketch_similarity(const sketch_t& a, const sketch_t& b) {
+
+    size_t n = 0;
+
+    for (size_t k = 0; k < SKETCH_SIZE; ++k)
+        n += (a.mins[k] == b.mins[k]);
+
+    return n;
+}
+
+/*
+ * Order inputs so that each one is followed by a similar one, when there is one.
+ *
+ * This is a greedy walk: the next input is the most similar unvisited input
+ * among those that share a band of bins with the current one; when there are
+ * none, it's the first unvisited input in the original order.
+ *
+ * Returns the indexes of the inputs in the new order.
+ */
+
+inline std::vector<size_t> similarity_order(const std::vector<sketch_t>& sketches) {
+
+    typedef std::map<uint64_t, std::vector<size_t> > buckets_t;
+
+    const size_t band = SKETCH_SIZE / SKETCH_BANDS;
+    const size_t max_candidates = 64;
+
+    size_t n = sketches.size();
+
+    std::vector<buckets_t> buckets(SKETCH_BANDS);
+    std::vector<uint64_t> keys(n * SKETCH_BANDS);
+
+    for (size_t k = 0; k < n; ++k) {
+        for (size_t b = 0; b < SKETCH_BANDS; ++b) {
+
+            uint64_t key = 0;
+
+            for (size_t j = 0; j < band; ++j)
+                key = (key * 0x100000001B3ULL) ^ sketches[k].mins[b * band + j];
+
+            keys[k * SKETCH_BANDS + b] = key;
+            buckets[b][key].push_back(k);
+        }
+    }
+
+    std::vector<bool> visited(n, false);
+    std::vector<size_t> ret;
+    ret.reserve(n);
+
+    size_t next_unvisited = 0;
+    size_t cur = 0;
+
+    while (ret.size() < n) {
+
+        visited[cur] = true;
+        ret.push_back(cur);
+
+        size_t best = n;
+        size_t best_sim = 0;
+
+        for (size_t b = 0; b < SKETCH_BANDS; ++b) {
+
+            std::vector<size_t>& bucket = buckets[b][keys[cur * SKETCH_BANDS + b]];
+
+            // At most 'max_candidates' unvisited inputs are checked per bucket.
+            // Visited inputs met on the way are swapped out of the bucket, so
+            // each entry is skipped at most once.
+
+            size_t checked = 0;
+            size_t r = 0;
+
+            while (r < bucket.size() && checked < max_candidates) {
+
+                size_t c = bucket[r];
+
+                if (visited[c]) {
+                    bucket[r] = bucket.back();
+                    bucket.pop_back();
+                    continue;
+                }
+
+                size_t sim = sketch_similarity(sketches[cur], sketches[c]);
+
+                if (sim > best_sim) {
+                    best = c;
+                    best_sim = sim;
+                }
+
+                ++checked;
+                ++r;
+            }
+        }
+
+        if (best == n) {
+
+            while (next_unvisited < n && visited[next_unvisited])
+                ++next_unvisited;
+
+            best = next_unvisited;
+        }
+
+        cur = best;
+    }
+
+    return ret;
+}
+
+/*
+ * The same for a batch of inputs: they are sketched on 'nthreads' threads first.
+ */
+
+inline std::vector<size_t> similarity_order(const std::vector<std::string>& inputs, size_t nthreads = 1) {
+
+    std::vector<sketch_t> sketches(inputs.size());
+
+    struct worker_t {
+        static void run(const std::vector<std::string>* inputs, std::vector<sketch_t>* sketches,
+                        size_t first, size_t step) {
+
+            for (size_t k = first; k < inputs->size(); k += step) {
+                const unsigned char* i = (const unsigned char*)(*inputs)[k].data();
+                make_sketch(i, i + (*inputs)[k].size(), (*sketches)[k]);
+            }
+        }
+    };
+
+    if (nthreads < 1)
+        nthreads = 1;
+
+    std::vector<std::thread> threads;
+
+    for (size_t t = 0; t < nthreads; ++t)
+        threads.push_back(std::thread(worker_t::run, &inputs, &sketches, t, nthreads));
+
+    for (size_t t = 0; t < nthreads; ++t)
+        threads[t].join();
+
+    return similarity_order(sketches);
+}
+
 }
 
 #endif
@@ -0,0 +1,341 @@
+#include <atomic>
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include "lz77.h"
+
+#include <stdio.h>
+
+
+// Sweep over the compressor's settings on a corpus of files and print the
+// Pareto frontier of compression speed, decompression speed and ratio: the
+// settings that no other setting beats on all three at once.
+//
+// Every setting is measured several times ('-r'), in rounds over all the settings,
+// and its fastest times count: that leaves out warm-up, and noise that lasts
+// longer than one measurement hits every setting alike. Settings can be measured
+// in parallel ('-j'), but threads that share cores and caches make the times
+// noisier, so the default is one thread.
+
+// 'chains' > 0 finds matches with hash chains of that depth (set_chains()) instead
+// of the buckets; 'searchlen' is 0 then, since it doesn't apply.
+
+struct config_t {
+    size_t searchlen;
+    size_t blocksize;
+    size_t level;
+    std::string hash;
+    size_t chains;
+};
+
+struct point_t {
+    config_t config;
+    double ctime;
+    double dtime;
+    size_t size;
+    size_t compressed;
+    size_t runs;
+    bool ok;
+
+    double cspeed() const { return size / ctime / 1e6; }
+    double dspeed() const { return size / dtime / 1e6; }
+    double ratio() const { return (double)size / compressed; }
+
+    bool dominates(const point_t& p) const {
+
+        bool ge = (cspeed() >= p.cspeed() && dspeed() >= p.dspeed() && ratio() >= p.ratio());
+        bool gt = (cspeed() > p.cspeed() || dspeed() > p.dspeed() || ratio() > p.ratio());
+
+        return ge && gt;
+    }
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    return d.count();
+}
+
+// One more run of a setting; keeps the fastest times.
+
+template <typename HASH>
+void measure(const std::vector<std::string>& corpus, point_t& p) {
+
+    double ctime = 0;
+    double dtime = 0;
+
+    p.size = 0;
+    p.compressed = 0;
+
+    lz77::basic_compress_t<HASH> compress(p.config.searchlen, p.config.blocksize);
+    compress.set_chains(p.config.chains);
+    compress.set_level(p.config.level);
+
+    for (const std::string& data : corpus) {
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::string out = compress.feed(data);
+        ctime += seconds_since(start);
+
+        lz77::decompress_t decompress;
+        std::string extra;
+
+        start = std::chrono::steady_clock::now();
+        decompress.feed(out, extra);
+        dtime += seconds_since(start);
+
+        if (decompress.result() != data)
+            p.ok = false;
+
+        p.size += data.size();
+        p.compressed += out.size();
+    }
+
+    if (p.runs == 0 || ctime < p.ctime)
+        p.ctime = ctime;
+
+    if (p.runs == 0 || dtime < p.dtime)
+        p.dtime = dtime;
+
+    ++p.runs;
+}
+
+void measure(const std::vector<std::string>& corpus, point_t& p) {
+
+    if (p.config.hash == "mul")
+        measure<lz77::multiply_hash_t>(corpus, p);
+    else if (p.config.hash == "crc")
+        measure<lz77::crc32c_hash_t>(corpus, p);
+    else
+        measure<lz77::fnv_hash_t>(corpus, p);
+}
+
+std::vector<size_t> parse_list(const char* s) {
+
+    std::vector<size_t> ret;
+
+    while (*s) {
+        char* e;
+        size_t v = ::strtoul(s, &e, 10);
+
+        if (e == s)
+            break;
+
+        ret.push_back(v);
+        s = (*e == ',' ? e + 1 : e);
+    }
+
+    return ret;
+}
+
+bool read_file(const char* name, std::string& data) {
+
+    std::ifstream in(name, std::ios::in | std::ios::binary);
+
+    if (!in)
+        return false;
+
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
+
+void print_csv(const std::vector<point_t>& points) {
+
+    std::cout << "searchlen,blocksize,level,hash,chains,compress_mb_s,decompress_mb_s,ratio,size,compressed" << std::endl;
+
+    for (const point_t& p : points) {
+        std::cout << p.config.searchlen << "," << p.config.blocksize << "," << p.config.level << ","
+                  << p.config.hash << "," << p.config.chains << "," << p.cspeed() << "," << p.dspeed() << ","
+                  << p.ratio() << "," << p.size << "," << p.compressed << std::endl;
+    }
+}
+
+void print_json(const std::vector<point_t>& points) {
+
+    std::cout << "[" << std::endl;
+
+    for (size_t n = 0; n < points.size(); ++n) {
+
+        const point_t& p = points[n];
+
+        std::cout << "  {\"searchlen\": " << p.config.searchlen << ", \"blocksize\": " << p.config.blocksize
+                  << ", \"level\": " << p.config.level << ", \"hash\": \"" << p.config.hash
+                  << "\", \"chains\": " << p.config.chains << ", \"compress_mb_s\": " << p.cspeed() << ", \"decompress_mb_s\": " << p.dspeed()
+                  << ", \"ratio\": " << p.ratio() << ", \"size\": " << p.size
+                  << ", \"compressed\": " << p.compressed << "}" << (n + 1 < points.size() ? "," : "") << std::endl;
+    }
+
+    std::cout << "]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+    std::vector<size_t> searchlens = { 1, 2, 4, 8, 12, 16 };
+    std::vector<size_t> blocksizes = { 4096, 16384, 65536 };
+    std::vector<size_t> levels;
+    std::vector<std::string> hashes = { "fnv", "mul", "crc" };
+    std::vector<size_t> chains = { 0 };
+    size_t nthreads = 1;
+    size_t reps = 5;
+    bool json = false;
+    bool all = false;
+    std::vector<std::string> corpus;
+
+    for (size_t l = 0; l < lz77::LEVELS; ++l)
+        levels.push_back(l);
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+
+        if (arg == "-s" && i + 1 < argc) {
+            searchlens = parse_list(argv[++i]);
+        } else if (arg == "-b" && i + 1 < argc) {
+            blocksizes = parse_list(argv[++i]);
+        } else if (arg == "-l" && i + 1 < argc) {
+            levels = parse_list(argv[++i]);
+        } else if (arg == "-H" && i + 1 < argc) {
+            hashes.clear();
+
+            for (const char* h = argv[++i]; *h; ) {
+                const char* e = ::strchr(h, ',');
+                hashes.push_back(e ? std::string(h, e) : std::string(h));
+                h = (e ? e + 1 : h + ::strlen(h));
+            }
+        } else if (arg == "--chains" && i + 1 < argc) {
+            chains = parse_list(argv[++i]);
+        } else if (arg == "-j" && i + 1 < argc) {
+            nthreads = ::atol(argv[++i]);
+        } else if (arg == "-r" && i + 1 < argc) {
+            reps = ::atol(argv[++i]);
+        } else if (arg == "--json") {
+            json = true;
+        } else if (arg == "--all") {
+            all = true;
+        } else {
+            std::string data;
+
+            if (!read_file(argv[i], data)) {
+                std::cerr << "Could not read " << argv[i] << std::endl;
+                return 1;
+            }
+
+            corpus.push_back(data);
+        }
+    }
+
+    if (corpus.empty()) {
+        ::fprintf(stderr,
+                  "Usage: %s [-s SEARCHLENS] [-b BLOCKSIZES] [-l LEVELS] [-H HASHES] [--chains DEPTHS] [-j THREADS] [-r REPS] [--json] [--all] FILES...\n"
+                  "  Measures every combination of the given settings (comma-separated lists;\n"
+                  "  the defaults are -s 1,2,4,8,12,16 -b 4096,16384,65536 -l 0,...,%d -H fnv,mul,crc\n"
+                  "  --chains 0) on the files, and prints the Pareto frontier of compression speed,\n"
+                  "  decompression speed and ratio as CSV, or as JSON with '--json'.\n"
+                  "  A chain depth of 0 means the buckets; other depths use hash chains, for which\n"
+                  "  the searchlens don't apply.\n"
+                  "  '--all' prints every setting instead of the frontier only.\n"
+                  "  The times are the best of REPS rounds (default 5) on THREADS threads (default 1).\n",
+                  argv[0], (int)lz77::LEVELS - 1);
+        return 1;
+    }
+
+    if (nthreads == 0)
+        nthreads = 1;
+
+    if (reps == 0)
+        reps = 1;
+
+    std::vector<point_t> points;
+
+    for (size_t depth : chains) {
+        for (size_t searchlen : searchlens) {
+            for (size_t blocksize : blocksizes) {
+                for (size_t level : levels) {
+                    for (const std::string& hash : hashes) {
+
+                        if (searchlen == 0 || blocksize == 0 || blocksize > 0x10000 || level >= lz77::LEVELS)
+                            continue;
+
+                        // Chains run once for all the searchlens.
+                        if (depth > 0 && searchlen != searchlens[0])
+                            continue;
+
+                        if (hash != "fnv" && hash != "mul" && hash != "crc") {
+                            std::cerr << "Unknown hash: " << hash << std::endl;
+                            return 1;
+                        }
+
+                        point_t p;
+                        p.config.searchlen = (depth > 0 ? 0 : searchlen);
+                        p.config.blocksize = blocksize;
+                        p.config.level = level;
+                        p.config.hash = hash;
+                        p.config.chains = depth;
+                        p.runs = 0;
+                        p.ok = true;
+                        points.push_back(p);
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t r = 0; r < reps; ++r) {
+
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> threads;
+
+        for (size_t t = 0; t < nthreads; ++t) {
+
+            threads.emplace_back([&]() {
+
+                while (1) {
+                    size_t n = next++;
+
+                    if (n >= points.size())
+                        break;
+
+                    measure(corpus, points[n]);
+                }
+            });
+        }
+
+        for (std::thread& t : threads)
+            t.join();
+    }
+
+    std::vector<point_t> frontier;
+
+    for (const point_t& p : points) {
+
+        if (!p.ok) {
+            std::cerr << "Round trip failed with searchlen " << p.config.searchlen << ", blocksize "
+                      << p.config.blocksize << ", level " << p.config.level << ", hash " << p.config.hash
+                      << ", chains " << p.config.chains << std::endl;
+            return 1;
+        }
+
+        bool dominated = false;
+
+        for (const point_t& q : points) {
+
+            if (q.dominates(p)) {
+                dominated = true;
+                break;
+            }
+        }
+
+        if (all || !dominated)
+            frontier.push_back(p);
+    }
+
+    std::sort(frontier.begin(), frontier.end(), [](const point_t& a, const point_t& b) {
+        return a.ratio() > b.ratio();
+    });
+
+    if (json)
+        print_json(frontier);
+    else
+        print_csv(frontier);
+
+    return 0;
+}
@@ -38,16 +38,625 @@ struct bm_s {
 #include "lz77.h"
 
 #include <fstream>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+// Other codecs for 'testlz77 -C'; the Makefile defines these when the libraries are installed.
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+
+// Decode in 64 kilobyte chunks, as from a stream, and print what the data is made of.
+
+bool decode_stats(const std::string& out, const std::string& inp) {
+
+    lz77::decompress_t decompress;
+    decompress.collect_stats = true;
+
+    std::string extra;
+    double t = 0;
+
+    {
+        bm_s _x(t);
+
+        for (size_t n = 0; n < out.size(); n += 64 * 1024) {
+            size_t l = std::min(out.size() - n, (size_t)64 * 1024);
+            decompress.feed((const unsigned char*)out.data() + n, (const unsigned char*)out.data() + n + l, extra);
+        }
+    }
+
+    if (decompress.result() != inp) {
+        std::cout << "Chunked decompression failed!" << std::endl;
+        return false;
+    }
+
+    const lz77::decode_stats_t& s = decompress.stats;
+
+    std::cout << "Chunked decompression time: " << t << std::endl
+              << "Literal tokens:    " << s.literal_tokens << " (" << s.literal_bytes << " bytes)" << std::endl
+              << "Match tokens:      " << s.match_tokens << " (" << s.match_bytes << " bytes)" << std::endl
+              << "Match copies:      " << s.memcpy_bytes << " bytes memcpy, " << s.overlap_bytes
+              << " bytes overlapping, " << s.history_bytes << " bytes from history" << std::endl
+              << "Resumptions:       " << s.partial_vlqs << " in a number, " << s.partial_literals
+              << " in a literal, " << s.partial_tokens << " between tokens" << std::endl
+              << "Match offsets:" << std::endl;
+
+    for (size_t n = 0; n < lz77::decode_stats_t::OFFSET_CLASSES; ++n) {
+
+        if (s.offsets[n] > 0)
+            std::cout << "  < 2^" << n << ": " << s.offsets[n] << std::endl;
+    }
+
+    return true;
+}
+
+// Many threads, each compressing and decompressing small messages with its own
+// compress_t and decompress_t, for about half a second. Returns messages per second.
+// (Each message clears the compressor's hash table, so with the default table
+// size this is mostly a test of memory bandwidth.)
+
+double bench_messages(const std::string& inp, size_t nthreads, size_t msgsize, size_t searchlen, size_t blocksize) {
+
+    size_t nmsgs = inp.size() / msgsize;
+    std::vector<size_t> counts(nthreads);
+    std::vector<std::thread> threads;
+
+    double t = 0;
+
+    {
+        bm_s _x(t);
+
+        for (size_t k = 0; k < nthreads; ++k) {
+
+            threads.emplace_back([&, k]() {
+
+                lz77::compress_t compress(searchlen, blocksize);
+                lz77::decompress_t decompress;
+                std::string extra;
+
+                std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+                size_t n = k * nmsgs / nthreads;
+
+                // Counted locally and stored once: neighbouring slots of 'counts'
+                // share a cache line, so counting in place would bounce it between cores.
+                size_t done = 0;
+
+                while (std::chrono::steady_clock::now() < end) {
+
+                    for (size_t j = 0; j < 16; ++j) {
+
+                        std::string msg = compress.feed(inp.substr((n % nmsgs) * msgsize, msgsize));
+                        decompress.feed(msg, extra);
+
+                        if (decompress.result().size() != msgsize)
+                            throw std::runtime_error("Message round trip failed");
+
+                        ++n;
+                        ++done;
+                    }
+                }
+
+                counts[k] = done;
+            });
+        }
+
+        for (std::thread& th : threads)
+            th.join();
+    }
+
+    size_t total = 0;
+
+    for (size_t c : counts)
+        total += c;
+
+    return total / t;
+}
+
+void bench_threads(const std::string& inp, size_t maxthreads, size_t msgsize) {
+
+    if (inp.size() < msgsize) {
+        std::cout << "The input is smaller than one message." << std::endl;
+        return;
+    }
+
+    size_t tables[][2] = { { lz77::DEFAULT_SEARCHLEN, lz77::DEFAULT_BLOCKSIZE }, { 12, 4096 } };
+
+    for (size_t k = 0; k < 2; ++k) {
+
+        std::cout << "Messages of " << msgsize << " bytes, compress_t(" << tables[k][0] << ", " << tables[k][1] << "):" << std::endl;
+
+        double one = 0;
+
+        for (size_t n = 1; ; n = std::min(n * 2, maxthreads)) {
+
+            double rate = bench_messages(inp, n, msgsize, tables[k][0], tables[k][1]);
+
+            if (n == 1)
+                one = rate;
+
+            std::cout << "  " << n << " threads: " << (size_t)rate << " messages/s, "
+                      << rate * msgsize / 1e6 << " MB/s, scaling efficiency "
+                      << rate / (n * one) * 100 << "%" << std::endl;
+
+            if (n == maxthreads)
+                break;
+        }
+    }
+}
+
+// One line of the codec comparison: both directions timed with bm_s, around the
+// codec calls only, on the same in-memory input. 'compress' returns false on failure.
+
+template <typename COMPRESS, typename DECOMPRESS>
+void bench_codec(const char* name, const std::string& inp, COMPRESS compress, DECOMPRESS decompress) {
+
+    std::string packed;
+    std::string unpacked;
+    double ctime = 0;
+    double dtime = 0;
+    bool ok;
+
+    {
+        bm_s _x(ctime);
+        ok = compress(inp, packed);
+    }
+
+    if (ok) {
+        bm_s _x(dtime);
+        ok = decompress(packed, unpacked, inp.size());
+    }
+
+    if (!ok || unpacked != inp) {
+        std::cout << name << ": failed" << std::endl;
+        return;
+    }
+
+    std::cout << name << ": compression " << inp.size() / ctime / 1e6 << " MB/s, decompression "
+              << inp.size() / dtime / 1e6 << " MB/s, size " << packed.size() << ", ratio "
+              << (double)inp.size() / packed.size() << std::endl;
+}
+
+void bench_codecs(const std::string& inp) {
+
+    bench_codec("yalz77 fast", inp,
+        [](const std::string& in, std::string& out) {
+            lz77::fast_compress_t<> compress;
+            out = compress.feed(in);
+            return true;
+        },
+        [](const std::string& in, std::string& out, size_t) {
+            lz77::decompress_t decompress;
+            std::string extra;
+            bool ok = decompress.feed(in, extra);
+            out.swap(decompress.result());
+            return ok;
+        });
+
+    bench_codec("yalz77", inp,
+        [](const std::string& in, std::string& out) {
+            lz77::compress_t compress;
+            out = compress.feed(in);
+            return true;
+        },
+        [](const std::string& in, std::string& out, size_t) {
+            lz77::decompress_t decompress;
+            std::string extra;
+            bool ok = decompress.feed(in, extra);
+            out.swap(decompress.result());
+            return ok;
+        });
+
+#ifdef HAVE_ZLIB
+    for (int level : { 1, 6 }) {
+
+        std::string name = "zlib -" + std::to_string(level);
+
+        bench_codec(name.c_str(), inp,
+            [level](const std::string& in, std::string& out) {
+                uLongf size = ::compressBound(in.size());
+                out.resize(size);
+                bool ok = (::compress2((Bytef*)&out[0], &size, (const Bytef*)in.data(), in.size(), level) == Z_OK);
+                out.resize(size);
+                return ok;
+            },
+            [](const std::string& in, std::string& out, size_t n) {
+                uLongf size = n;
+                out.resize(n);
+                return ::uncompress((Bytef*)&out[0], &size, (const Bytef*)in.data(), in.size()) == Z_OK && size == n;
+            });
+    }
+#endif
+
+#ifdef HAVE_LZ4
+    bench_codec("lz4", inp,
+        [](const std::string& in, std::string& out) {
+            out.resize(::LZ4_compressBound(in.size()));
+            int size = ::LZ4_compress_default(in.data(), &out[0], in.size(), out.size());
+            out.resize(size);
+            return size > 0;
+        },
+        [](const std::string& in, std::string& out, size_t n) {
+            out.resize(n);
+            return ::LZ4_decompress_safe(in.data(), &out[0], in.size(), n) == (int)n;
+        });
+#endif
+
+#ifdef HAVE_ZSTD
+    for (int level : { 1, 3 }) {
+
+        std::string name = "zstd -" + std::to_string(level);
+
+        bench_codec(name.c_str(), inp,
+            [level](const std::string& in, std::string& out) {
+                out.resize(::ZSTD_compressBound(in.size()));
+                size_t size = ::ZSTD_compress(&out[0], out.size(), in.data(), in.size(), level);
+
+                if (::ZSTD_isError(size))
+                    return false;
+
+                out.resize(size);
+                return true;
+            },
+            [](const std::string& in, std::string& out, size_t n) {
+                out.resize(n);
+                return ::ZSTD_decompress(&out[0], n, in.data(), in.size()) == n;
+            });
+    }
+#endif
+}
+
+// Match finders side by side: the buckets of offsets_dict_t at each level, and
+// hash chains of several depths and windows at the default level.
+
+void bench_finder(const std::string& inp, lz77::compress_t& compress, const std::string& name) {
+
+    std::string out;
+    double t = 0;
+
+    {
+        bm_s _x(t);
+        out = compress.feed(inp);
+    }
+
+    // Both finders count: only the one in use should have memory allocated.
+    size_t memory = compress.offsets.offsets.capacity() * sizeof(size_t) +
+        (compress.chains.head.capacity() + compress.chains.prev.capacity()) * sizeof(uint32_t);
+
+    lz77::decompress_t decompress;
+    std::string extra;
+    decompress.feed(out, extra);
+
+    std::cout << name << ": " << memory / 1024 << " KB, " << inp.size() / t / 1e6 << " MB/s, size "
+              << out.size() << (decompress.result() == inp ? "" : " (round trip failed!)") << std::endl;
+}
+
+void bench_finders(const std::string& inp) {
+
+    for (size_t level = 1; level < lz77::LEVELS; ++level) {
+
+        lz77::compress_t compress;
+        compress.set_level(level);
+
+        bench_finder(inp, compress, "buckets, level " + std::to_string(level));
+    }
+
+    for (size_t bits : { 16, 20, 22 }) {
+        for (size_t depth : { 2, 4, 8, 16, 32 }) {
+
+            lz77::compress_t compress;
+            compress.set_chains(depth, bits);
+
+            bench_finder(inp, compress, "chains, window 2^" + std::to_string(bits) + ", depth " + std::to_string(depth));
+        }
+    }
+}
+
+// Append mode: compress in chunks of 'chunk' bytes, one frame each, and decode the
+// frames 7 bytes at a time, so that sizes and trailers are split between feeds.
+// A decoder without a window must reject the frames.
+
+bool check_append(const std::string& inp, size_t chunk) {
+
+    lz77::compress_t compress(lz77::DEFAULT_SEARCHLEN, lz77::DEFAULT_BLOCKSIZE, lz77::DEFAULT_WINDOW);
+    std::string out;
+
+    for (size_t n = 0; n < inp.size(); n += chunk)
+        out += compress.feed(inp.substr(n, chunk));
+
+    std::cout << "Append-mode size:  " << out.size() << std::endl;
+
+    lz77::decompress_t decompress(0, lz77::DEFAULT_WINDOW);
+    std::string res;
+    std::string extra;
+
+    for (size_t n = 0; n < out.size(); n += 7) {
+
+        std::string buf = out.substr(n, 7);
+
+        while (buf.size() > 0) {
+
+            extra.clear();
+
+            if (!decompress.feed(buf, extra))
+                break;
+
+            res += decompress.result();
+            buf.swap(extra);
+        }
+    }
+
+    if (res != inp) {
+        std::cout << "Append-mode compression-decompression equivalence test failed!" << std::endl;
+        return false;
+    }
+
+    try {
+        lz77::decompress_t plain;
+        plain.feed(out, extra);
+
+    } catch (std::exception&) {
+        return true;
+    }
+
+    std::cout << "Append-mode frames were decoded without a window!" << std::endl;
+    return false;
+}
+
+// Order 'n' inputs that are all copies of one string, every other one with one
+// byte changed, so that all sketches collide; this must stay near-linear.
+
+bool check_order(const std::string& inp, size_t n) {
+
+    std::string base = inp.substr(0, 4096);
+    std::vector<lz77::sketch_t> sketches(n);
+
+    for (size_t k = 0; k < n; ++k) {
+
+        std::string s = base;
+
+        if (k % 2 == 1 && s.size() > 0)
+            s[k % s.size()] ^= 1;
+
+        const unsigned char* i = (const unsigned char*)s.data();
+        lz77::make_sketch(i, i + s.size(), sketches[k]);
+    }
+
+    std::vector<size_t> order;
+    double t = 0;
+
+    {
+        bm_s _x(t);
+        order = lz77::similarity_order(sketches);
+    }
+
+    std::vector<bool> seen(n, false);
+    bool ok = (order.size() == n);
+
+    for (size_t k = 0; ok && k < order.size(); ++k) {
+        ok = (order[k] < n && !seen[order[k]]);
+        seen[order[k]] = true;
+    }
+
+    std::cout << "Similarity order of " << n << " colliding inputs: " << t << " s" << std::endl;
+
+    if (!ok) {
+        std::cout << "Similarity order is not a permutation!" << std::endl;
+        return false;
+    }
+
+    // Quadratic behaviour took 16 s for 40000 inputs.
+    if (t > 2.0 * n / 40000 + 0.1) {
+        std::cout << "Similarity order is too slow!" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Compression within 'seconds': every fixed level is timed first, and if one of them
+// finished within 90% of the deadline (what the pacing aims for) the paced
+// compression must meet the deadline too.
+
+bool check_deadline(const std::string& inp, double seconds) {
+
+    bool feasible = false;
+    size_t best = 0;
+
+    for (size_t level = 0; level < lz77::LEVELS; ++level) {
+
+        lz77::compress_t compress;
+        compress.set_level(level);
+
+        std::string out;
+        double t = 0;
+
+        {
+            bm_s _x(t);
+            out = compress.feed(inp);
+        }
+
+        std::cout << "Level " << level << ": " << t << " s, size " << out.size() << std::endl;
+
+        if (t <= 0.9 * seconds && (!feasible || out.size() < best)) {
+            feasible = true;
+            best = out.size();
+        }
+    }
+
+    std::string paced;
+    double t = 0;
+
+    {
+        bm_s _x(t);
+        lz77::compress_t compress;
+        paced = compress.feed(inp, seconds);
+    }
+
+    std::cout << "Paced compression time: " << t << std::endl;
+    std::cout << "Paced size:        " << paced.size();
+
+    if (feasible)
+        std::cout << " (best fixed level within 90% of the deadline: " << best << ")";
+
+    std::cout << std::endl;
+
+    lz77::decompress_t d;
+    std::string extra;
+    d.feed(paced, extra);
+
+    if (d.result() != inp) {
+        std::cout << "Paced compression-decompression equivalence test failed!" << std::endl;
+        return false;
+    }
+
+    if (feasible && t > seconds) {
+        std::cout << "Paced compression missed a deadline that a fixed level met!" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Latency percentiles recorded by the library; only when built with -DLZ77_METRICS=1.
+
+void print_metrics() {
+
+    if (!LZ77_METRICS)
+        return;
+
+    lz77::metrics_t m = lz77::metrics_snapshot();
+    const char* names[] = { "compress", "decompress" };
+
+    for (size_t k = 0; k < lz77::metrics_t::CALLS; ++k) {
+
+        for (size_t c = 0; c < lz77::SIZE_CLASSES; ++c) {
+
+            const lz77::histogram_t& h = m.calls[k].latency[c];
+
+            if (h.count == 0)
+                continue;
+
+            std::cout << names[k] << " calls of size class " << c << ": " << h.count
+                      << ", p50 " << h.percentile(0.5) << " ns, p99 " << h.percentile(0.99)
+                      << " ns, p999 " << h.percentile(0.999) << " ns, max " << h.max << " ns" << std::endl;
+        }
+    }
+}
+
+// Speed and bucket distribution of a hash policy. The distribution is measured
+// over the distinct MIN_RUN-byte prefixes in the input; a chi-square per degree
+// of freedom near 1 means the buckets are as even as random.
+
+template <typename HASH>
+void bench_hash(const char* name, const std::string& inp) {
+
+    const unsigned char* b = (const unsigned char*)inp.data();
+    const unsigned char* e = b + inp.size() - lz77::MIN_RUN;
+
+    double htime = 0;
+    double ctime = 0;
+    volatile uint32_t sum = 0;
+    std::string out;
+
+    {
+        bm_s _x(htime);
+
+        for (const unsigned char* i = b; i <= e; ++i)
+            sum += HASH::hash(i);
+    }
+
+    {
+        bm_s _x(ctime);
+        lz77::basic_compress_t<HASH> compress;
+        out = compress.feed(inp);
+    }
+
+    std::unordered_set<uint64_t> seen;
+    std::vector<size_t> buckets(lz77::DEFAULT_BLOCKSIZE);
+
+    for (const unsigned char* i = b; i <= e; ++i) {
+
+        uint64_t key = 0;
+        ::memcpy(&key, i, lz77::MIN_RUN);
+
+        if (seen.insert(key).second)
+            ++buckets[HASH::hash(i) % lz77::DEFAULT_BLOCKSIZE];
+    }
+
+    double m = (double)seen.size() / buckets.size();
+    double chi2 = 0;
+
+    for (size_t n = 0; n < buckets.size(); ++n)
+        chi2 += (buckets[n] - m) * (buckets[n] - m) / m;
+
+    chi2 /= (buckets.size() - 1);
+
+    std::cout << name << ": hashing " << htime << " s, compression " << ctime << " s, size "
+              << out.size() << ", chi2/dof " << chi2 << std::endl;
+}
 
 int main(int argc, char** argv) {
 
     if (argc < 2) {
         std::cout << "Usage: " << argv[0] << " 'string to compress'" << std::endl
-                  << "       " << argv[0] << " -f file_to_compress" << std::endl;
+                  << "       " << argv[0] << " -f file_to_compress [-g pattern] [-p page_size] [-s sampling] [-D seconds] [-H] [-T] [-C] [-K] [-O count] [-a chunk_size] [-M threads [-B message_size]]" << std::endl;
         return 0;
     }
 
     std::string inp(argv[1]);
+    std::string pattern;
+    size_t page_size = 0;
+    size_t sampling = 0;
+    double deadline = 0;
+    bool hashes = false;
+    bool stats = false;
+    size_t maxthreads = 0;
+    size_t msgsize = 4096;
+    bool codecs = false;
+    bool finders = false;
+    size_t norder = 0;
+    size_t chunk = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "-H")
+            hashes = true;
+        else if (std::string(argv[i]) == "-T")
+            stats = true;
+        else if (std::string(argv[i]) == "-C")
+            codecs = true;
+        else if (std::string(argv[i]) == "-K")
+            finders = true;
+    }
+
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string(argv[i]) == "-g")
+            pattern = argv[i + 1];
+        else if (std::string(argv[i]) == "-p")
+            page_size = ::atol(argv[i + 1]);
+        else if (std::string(argv[i]) == "-s")
+            sampling = ::atol(argv[i + 1]);
+        else if (std::string(argv[i]) == "-D")
+            deadline = ::atof(argv[i + 1]);
+        else if (std::string(argv[i]) == "-M")
+            maxthreads = ::atol(argv[i + 1]);
+        else if (std::string(argv[i]) == "-B")
+            msgsize = ::atol(argv[i + 1]);
+        else if (std::string(argv[i]) == "-O")
+            norder = ::atol(argv[i + 1]);
+        else if (std::string(argv[i]) == "-a")
+            chunk = ::atol(argv[i + 1]);
+    }
 
     if (inp == "-f") {
         bm _x1("File reading time");
@@ -68,7 +677,7 @@ int main(int argc, char** argv) {
 
     } else if (inp == "-h" || inp == "--help") {
         std::cout << "Usage: " << argv[0] << " 'string to compress'" << std::endl
-                  << "       " << argv[0] << " -f file_to_compress" << std::endl;
+                  << "       " << argv[0] << " -f file_to_compress [-g pattern] [-p page_size] [-s sampling] [-D seconds] [-H] [-T] [-C] [-K] [-O count] [-a chunk_size] [-M threads [-B message_size]]" << std::endl;
         return 0;
     }
 
@@ -95,6 +704,19 @@ int main(int argc, char** argv) {
         }
     }
 
+    lz77::decompress_t trusted;
+
+    {
+        bm _x2("Decompression time (trusted)");
+        std::string extra;
+        trusted.feed_trusted(out, extra);
+    }
+
+    if (trusted.result() != inp) {
+        std::cout << "Trusted decompression failed!" << std::endl;
+        return 1;
+    }
+
     if (decompress.result() != inp) {
         std::cout << "Compression-decompression equivalence test failed!" << std::endl;
 
@@ -104,6 +726,145 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    if (pattern.size() > 0) {
+
+        size_t n = 0;
+
+        {
+            bm _x3("Decompress-then-search time");
+            lz77::decompress_t d;
+            std::string extra;
+            d.feed(out, extra);
+
+            const std::string& r = d.result();
+            size_t i = r.find(pattern);
+
+            while (i != std::string::npos) {
+                ++n;
+                i = r.find(pattern, i + 1);
+            }
+        }
+
+        std::cout << "Occurrences:       " << n << std::endl;
+    }
+
+    if (sampling > 0) {
+
+        lz77::compress_t::estimate_t est;
+
+        {
+            bm _x7("Estimation time");
+            lz77::compress_t compress;
+            est = compress.estimate_compressed_size(inp, sampling);
+        }
+
+        std::cout << "Estimated size:    " << est.size << " +- " << est.error << std::endl;
+
+        size_t off = (est.size > out.size() ? est.size - out.size() : out.size() - est.size);
+
+        if (off > est.error) {
+            std::cout << "Estimate is off by more than its error!" << std::endl;
+            return 1;
+        }
+    }
+
+    if (stats && !decode_stats(out, inp))
+        return 1;
+
+    if (maxthreads > 0 && msgsize > 0)
+        bench_threads(inp, maxthreads, msgsize);
+
+    if (codecs)
+        bench_codecs(inp);
+
+    if (finders)
+        bench_finders(inp);
+
+    if (norder > 0 && !check_order(inp, norder))
+        return 1;
+
+    if (chunk > 0 && !check_append(inp, chunk))
+        return 1;
+
+    if (hashes) {
+        bench_hash<lz77::fnv_hash_t>("fnv", inp);
+        bench_hash<lz77::multiply_hash_t>("multiply", inp);
+        bench_hash<lz77::crc32c_hash_t>("crc32c", inp);
+    }
+
+    if (deadline > 0 && !check_deadline(inp, deadline))
+        return 1;
+
+    if (page_size > 0) {
+
+        size_t npages = inp.size() / page_size;
+
+        std::string slots;
+        slots.resize(npages * page_size);
+        std::vector<size_t> sizes(npages);
+
+        unsigned char* frames;
+        if (::posix_memalign((void**)&frames, 4096, npages * page_size) != 0)
+            return 1;
+
+        ::memset(frames, 0, npages * page_size);
+
+        double ctime = 0;
+        double dtime = 0;
+        size_t packed = 0;
+        size_t total = 0;
+
+        {
+            bm_s _x5(ctime);
+            lz77::page_compress_t<> pc;
+
+            for (size_t n = 0; n < npages; ++n) {
+                const unsigned char* p = (const unsigned char*)inp.data() + n * page_size;
+                unsigned char* slot = (unsigned char*)slots.data() + n * page_size;
+                sizes[n] = pc.feed(p, p + page_size, slot, slot + page_size);
+            }
+        }
+
+        {
+            bm_s _x6(dtime);
+
+            for (size_t n = 0; n < npages; ++n) {
+
+                if (sizes[n] == 0)
+                    continue;
+
+                const unsigned char* slot = (const unsigned char*)slots.data() + n * page_size;
+                unsigned char* frame = frames + n * page_size;
+                lz77::decompress_page(slot, slot + sizes[n], frame, frame + page_size);
+            }
+        }
+
+        for (size_t n = 0; n < npages; ++n) {
+
+            if (sizes[n] == 0) {
+                total += page_size;
+                continue;
+            }
+
+            ++packed;
+            total += sizes[n];
+
+            if (::memcmp(frames + n * page_size, inp.data() + n * page_size, page_size) != 0) {
+                std::cout << "Page compression-decompression equivalence test failed!" << std::endl;
+                return 1;
+            }
+        }
+
+        ::free(frames);
+
+        std::cout << "Pages:             " << npages << " (" << packed << " compressed)" << std::endl;
+        std::cout << "Page compressed:   " << total << std::endl;
+        std::cout << "Page compression:  " << ctime * 1e6 / npages << " us/page" << std::endl;
+        std::cout << "Page decompression: " << dtime * 1e6 / npages << " us/page" << std::endl;
+    }
+
+    print_metrics();
+
     return 0;
 }
 
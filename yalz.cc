@@ -1,53 +1,1302 @@
 #include <iostream>
+#include <thread>
 #include "lz77.h"
 
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
-int main(int argc, char** argv) {
+// Output for 'yalz -d -S': aligned blocks of zeros are skipped with lseek,
+// which leaves holes in the output file. Falls back to writing the zeros
+// when stdout is not a regular file or is opened for appending (where
+// seeking has no effect on where the next write goes).
+
+struct sparse_writer_t {
+
+    enum {
+        BLOCKSIZE = 4096
+    };
+
+    int fd;
+    bool seekable;
+    size_t pos;
+    size_t hole;
+
+    sparse_writer_t() : fd(::fileno(stdout)), pos(0), hole(0) {
+
+        ::fflush(stdout);
+
+        struct stat st;
+        int flags = ::fcntl(fd, F_GETFL);
+        off_t off = ::lseek(fd, 0, SEEK_CUR);
+
+        seekable = (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+                    flags != -1 && !(flags & O_APPEND) && off != (off_t)-1);
+
+        if (seekable)
+            pos = off;
+    }
+
+    static bool zeros(const unsigned char* i, size_t n) {
+
+        uint64_t acc = 0;
+
+        for (; n >= 8; n -= 8, i += 8) {
+            uint64_t v;
+            ::memcpy(&v, i, 8);
+            acc |= v;
+        }
+
+        for (; n > 0; --n, ++i)
+            acc |= *i;
+
+        return acc == 0;
+    }
+
+    void put(const unsigned char* i, size_t n) {
+
+        while (n > 0) {
+
+            ssize_t r = ::write(fd, i, n);
+
+            if (r <= 0)
+                throw std::runtime_error("Write error");
+
+            i += r;
+            n -= r;
+        }
+    }
+
+    void flush_hole() {
+
+        if (hole == 0)
+            return;
+
+        if (seekable) {
+            ::lseek(fd, hole, SEEK_CUR);
+
+        } else {
+            static const unsigned char z[BLOCKSIZE] = { 0 };
+
+            while (hole > 0) {
+                size_t l = (hole < BLOCKSIZE ? hole : BLOCKSIZE);
+                put(z, l);
+                hole -= l;
+            }
+        }
+
+        hole = 0;
+    }
+
+    void write(const unsigned char* i, size_t n) {
+
+        while (n > 0) {
+
+            // Blocks are aligned to the position in the output file.
+            size_t l = BLOCKSIZE - (pos % BLOCKSIZE);
+
+            if (l > n)
+                l = n;
+
+            if (l == BLOCKSIZE && zeros(i, l)) {
+                hole += l;
+
+            } else {
+                flush_hole();
+                put(i, l);
+            }
+
+            i += l;
+            n -= l;
+            pos += l;
+        }
+    }
+
+    // A trailing hole needs one byte written at its end to set the file size.
+
+    void finish() {
+
+        if (hole == 0)
+            return;
+
+        --hole;
+        flush_hole();
+
+        unsigned char z = 0;
+        put(&z, 1);
+    }
+};
+
+// Output for 'yalz -d -m FILE': every frame is decoded straight into FILE,
+// which is grown to fit the frame and memory-mapped. The kernel writes
+// the pages back.
+
+struct mmap_writer_t {
+
+    int fd;
+    size_t pos;
+    unsigned char* map;
+    size_t map_size;
+
+    mmap_writer_t(const char* fname) : pos(0), map(NULL), map_size(0) {
+
+        fd = ::open(fname, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+        if (fd < 0)
+            throw std::runtime_error("Could not open output file");
+    }
+
+    ~mmap_writer_t() {
+        done();
+        ::close(fd);
+    }
+
+    static unsigned char* alloc(void* ctx, size_t size) {
+
+        mmap_writer_t* self = (mmap_writer_t*)ctx;
+        static unsigned char empty;
+
+        self->done();
+
+        if (size == 0)
+            return &empty;
+
+        // Mappings start at a page boundary.
+        size_t page = ::sysconf(_SC_PAGESIZE);
+        size_t start = self->pos - (self->pos % page);
+
+        if (::ftruncate(self->fd, self->pos + size) != 0)
+            throw std::runtime_error("Could not grow output file");
+
+        self->map_size = self->pos + size - start;
+        void* m = ::mmap(NULL, self->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, start);
+
+        if (m == MAP_FAILED)
+            throw std::runtime_error("Could not map output file");
+
+        self->map = (unsigned char*)m;
+        unsigned char* ret = self->map + (self->pos - start);
+        self->pos += size;
+
+        return ret;
+    }
+
+    void done() {
+
+        if (map) {
+            ::munmap(map, map_size);
+            map = NULL;
+        }
+    }
+};
+
+// Append mode: recover the history that the next frame may reference from an existing file.
+//
+// The frames are walked back from the end of the file by their trailers to the last one
+// made without history, and only the frames from there on are decoded (see lz77::APPEND_RESTART).
+// Files whose frames have no trailers, or that don't end in a whole frame, are decoded from
+// the start instead.
+//
+// Fails if the file doesn't decode or ends in a partial frame (e.g. after a crash while
+// appending); the new frame would then be unreadable. 'good' is the size of the whole
+// frames, which the file can be truncated to.
+
+// The start of the last frame made without history, or false if the trailers don't lead to one.
+
+bool find_restart(FILE* f, size_t fsize, size_t& start, std::vector<size_t>& ends) {
+
+    size_t pos = fsize;
+    ends.clear();
+
+    while (pos > 0) {
+
+        unsigned char t[11];
+        size_t n = std::min(pos, sizeof(t));
+
+        if (::fseeko(f, pos - n, SEEK_SET) != 0 || ::fread(t, 1, n, f) != n)
+            return false;
+
+        size_t l = t[n - 1];
+
+        if (l == 0 || l >= n)
+            return false;
+
+        const unsigned char* i = t + n - 1 - l;
+        size_t v;
+
+        if (!lz77::read_vlq_uint(i, t + n - 1, v) || i != t + n - 1)
+            return false;
+
+        size_t len = (v >> 1);
+
+        if (len > pos - 1 - l)
+            return false;
+
+        ends.push_back(pos);
+        pos = pos - 1 - l - len;
+
+        if (v & 1) {
+            start = pos;
+            std::reverse(ends.begin(), ends.end());
+            return true;
+        }
+    }
+
+    return false;
+}
+
+template <typename COMPRESS>
+bool resume_history(const char* fname, COMPRESS& compress) {
+
+    FILE* f = ::fopen(fname, "rb");
+
+    if (!f)
+        return true;
+
+    size_t start = 0;
+    std::vector<size_t> ends;
+
+    if (::fseeko(f, 0, SEEK_END) != 0) {
+        ::fclose(f);
+        fprintf(stderr, "yalz: %s is not seekable\n", fname);
+        return false;
+    }
+
+    size_t fsize = ::ftello(f);
+
+    // Decode from the restart frame, checking that the frames end where the trailers say.
+
+    if (find_restart(f, fsize, start, ends)) {
+
+        std::string buff;
+        buff.resize(fsize - start);
+
+        if (::fseeko(f, start, SEEK_SET) == 0 && ::fread((void*)buff.data(), 1, buff.size(), f) == buff.size()) {
+
+            lz77::decompress_t decompress(0, compress.window);
+            const unsigned char* b = (const unsigned char*)buff.data();
+            const unsigned char* i = b;
+            std::string extra;
+            size_t decoded = 0;
+            size_t k = 0;
+
+            try {
+                while (k < ends.size()) {
+
+                    if (!decompress.feed(i, b + buff.size(), extra) || !decompress.state.trailer)
+                        break;
+
+                    i = b + buff.size() - extra.size();
+                    decoded += decompress.result().size();
+
+                    if (start + (i - b) != ends[k])
+                        break;
+
+                    ++k;
+                }
+
+            } catch (std::exception&) {
+                k = 0;
+            }
+
+            if (k == ends.size()) {
+                ::fclose(f);
+                compress.prime(decompress.history);
+                compress.since_restart = decoded;
+                return true;
+            }
+        }
+    }
+
+    ::rewind(f);
+
+    lz77::decompress_t decompress(0, compress.window);
+    std::string buff;
+    std::string extra;
+    size_t fed = 0;
+    size_t good = 0;
+    size_t decoded = 0;
+
+    try {
+        while (1) {
+            buff.resize(100*1024);
+            size_t buff_size = ::fread((void*)buff.data(), 1, buff.size(), f);
+
+            if (buff_size == 0)
+                break;
+
+            buff.resize(buff_size);
+            fed += buff_size;
+
+            while (buff.size() > 0) {
+
+                if (!decompress.feed(buff, extra))
+                    break;
+
+                good = fed - extra.size();
+                decoded += decompress.result().size();
+                buff.swap(extra);
+            }
+        }
+
+    } catch (std::exception& ex) {
+        ::fclose(f);
+        fprintf(stderr, "yalz: %s: %s after byte %zu\n", fname, ex.what(), good);
+        return false;
+    }
+
+    ::fclose(f);
+
+    if (decompress.state.state != lz77::decompress_t::state_t::INIT || decompress.state.vlq_off != 0) {
+        fprintf(stderr, "yalz: %s: partial frame after byte %zu; truncate it to %zu bytes to resume\n",
+                fname, good, good);
+        return false;
+    }
+
+    compress.prime(decompress.history);
+    compress.since_restart = decoded;
+    return true;
+}
+
+// The first occurrence of 'pattern' in 'text' at or after 'from', or npos.
+
+size_t find(const std::string& text, const std::string& pattern, size_t from) {
+
+    const void* f = ::memmem(text.data() + from, text.size() - from, pattern.data(), pattern.size());
+    return (f ? (const char*)f - text.data() : std::string::npos);
+}
+
+// Print the lines of a decoded frame that contain the pattern.
+// 'line' carries the unterminated last line over to the next frame.
+
+bool print_lines(const std::string& text, const std::string& pattern, std::string& line) {
+
+    bool matched = false;
+
+    size_t nl = text.find('\n');
+
+    if (nl == std::string::npos) {
+        line.append(text);
+        return false;
+    }
+
+    line.append(text, 0, nl + 1);
+
+    if (line.find(pattern) != std::string::npos) {
+        ::fwrite(line.data(), 1, line.size(), stdout);
+        matched = true;
+    }
+
+    size_t last = text.rfind('\n');
+    size_t f = find(text, pattern, nl + 1);
+
+    while (f < last) {
+
+        size_t ls = text.rfind('\n', f) + 1;
+        size_t le = text.find('\n', f) + 1;
+
+        ::fwrite(text.data() + ls, 1, le - ls, stdout);
+        matched = true;
+
+        f = find(text, pattern, le);
+    }
+
+    line.assign(text, last + 1, std::string::npos);
+
+    return matched;
+}
+
+// 'yalz --grep': decode every frame, then search it with memmem().
+// Append-mode frames are decoded with a window, as in 'yalz -d'.
+// Like grep, exits with 1 if nothing matched and 2 on errors.
+
+int grep(const std::string& pattern, bool appendmode) {
+
+    const size_t BUFSIZE = 10*1024*1024;
+
+    lz77::decompress_t decompress(0, (appendmode ? lz77::DEFAULT_WINDOW : 0));
+    std::string buff;
+    std::string extra;
+    std::string line;
+    bool matched = false;
+
+    bool first = true;
+
+    buff.resize(BUFSIZE);
+
+    try {
+        while (1) {
+            size_t buff_size = ::fread((void*)buff.data(), 1, buff.size(), stdin);
+
+            if (buff_size == 0)
+                break;
+
+            if (first && lz77::append_frame((const unsigned char*)buff.data(), (const unsigned char*)buff.data() + buff_size))
+                decompress.window = lz77::DEFAULT_WINDOW;
+
+            first = false;
+
+            std::string* what = &buff;
+            size_t what_size = buff_size;
+
+            while (what_size > 0) {
+
+                const unsigned char* whatd = (const unsigned char*)what->data();
+
+                if (!decompress.feed(whatd, whatd + what_size, extra))
+                    break;
+
+                matched |= print_lines(decompress.result(), pattern, line);
+
+                what = &extra;
+                what_size = extra.size();
+            }
+
+            if (buff_size != BUFSIZE)
+                break;
+        }
+
+        if (decompress.state.state != lz77::decompress_t::state_t::INIT || decompress.state.vlq_off != 0)
+            throw std::runtime_error("Truncated compressed data");
+
+    } catch (std::exception& ex) {
+        ::fflush(stdout);
+        fprintf(stderr, "yalz: %s\n", ex.what());
+        return 2;
+    }
+
+    if (line.find(pattern) != std::string::npos) {
+        ::fwrite(line.data(), 1, line.size(), stdout);
+        ::fputc('\n', stdout);
+        matched = true;
+    }
+
+    return (matched ? 0 : 1);
+}
+
+// Compress stdin into a C++ header that embeds it as a lz77::asset_t called 'name'.
+// The variables are 'inline' (C++17), so the header can be included in several
+// files of a program and there is still one copy of the data and one asset.
+
+int embed(const std::string& name) {
+
+    std::string data;
+    std::string buff;
+
+    while (1) {
+        buff.resize(10*1024*1024);
+        size_t i = ::fread((void*)buff.data(), 1, buff.size(), stdin);
+        data.append(buff, 0, i);
+
+        if (i != buff.size())
+            break;
+    }
+
+    lz77::compress_t compress;
+    std::string out = compress.feed(data);
+
+    ::printf("// Generated by 'yalz -e %s'; %zu bytes compressed to %zu.\n\n"
+             "#include \"lz77.h\"\n\n"
+             "inline const unsigned char %s_data[] = {",
+             name.c_str(), data.size(), out.size(), name.c_str());
+
+    for (size_t i = 0; i < out.size(); ++i) {
+
+        if (i % 16 == 0)
+            ::printf("\n   ");
+
+        ::printf(" 0x%02x,", (unsigned char)out[i]);
+    }
+
+    ::printf("\n};\n\ninline lz77::asset_t %s(%s_data, sizeof(%s_data));\n",
+             name.c_str(), name.c_str(), name.c_str());
+
+    return 0;
+}
+
+// 'yalz -v': time and bytes per stage, printed to stderr every VERBOSE_PERIOD
+// seconds and on exit.
+
+struct verbose_t {
+
+    enum {
+        READ = 0,
+        CODE = 1,
+        WRITE = 2,
+        STAGES = 3,
+        VERBOSE_PERIOD = 5
+    };
+
+    typedef std::chrono::steady_clock clock_type;
+
+    bool decoding;
+    double seconds[STAGES];
+    size_t bytes[STAGES];
+    size_t chunks;
+    clock_type::time_point start;
+    clock_type::time_point last;
+
+    verbose_t(bool d) : decoding(d), chunks(0), start(clock_type::now()), last(start) {
+
+        for (size_t s = 0; s < STAGES; ++s) {
+            seconds[s] = 0;
+            bytes[s] = 0;
+        }
+    }
+
+    static double since(clock_type::time_point t) {
+        std::chrono::duration<double> d = clock_type::now() - t;
+        return d.count();
+    }
+
+    // Add the time since 't' and 'n' bytes to a stage.
+
+    void add(size_t stage, clock_type::time_point t, size_t n) {
+
+        seconds[stage] += since(t);
+        bytes[stage] += n;
+
+        if (since(last) >= VERBOSE_PERIOD) {
+            report();
+            last = clock_type::now();
+        }
+    }
+
+    void report() {
+
+        struct rusage ru;
+        ::getrusage(RUSAGE_SELF, &ru);
+
+        // Compression reads uncompressed data and writes compressed data; decoding the other way around.
+        size_t plain = (decoding ? bytes[WRITE] : bytes[READ]);
+        size_t packed = (decoding ? bytes[READ] : bytes[WRITE]);
+
+        fprintf(stderr, "yalz: %.3f s: read %zu bytes in %.3f s, %s %zu bytes in %.3f s (%.1f MB/s), "
+                "wrote %zu bytes in %.3f s; ratio %.3f, %zu %s",
+                since(start), bytes[READ], seconds[READ], (decoding ? "decoded" : "compressed"),
+                bytes[CODE], seconds[CODE], (seconds[CODE] > 0 ? bytes[CODE] / seconds[CODE] / 1e6 : 0.0),
+                bytes[WRITE], seconds[WRITE], (packed > 0 ? (double)plain / packed : 0.0),
+                chunks, (decoding ? "frames" : "chunks"));
+
+        if (decoding)
+            fprintf(stderr, " (%.1f frames/s)", (seconds[CODE] > 0 ? chunks / seconds[CODE] : 0.0));
+
+        fprintf(stderr, ", peak RSS %ld KB\n", (long)ru.ru_maxrss);
+    }
+};
+
+verbose_t* verbose = NULL;
+
+// 'yalz -c': compress stdin in chunks of 'bufsize' bytes, one frame per chunk.
+
+template <typename COMPRESS>
+void compress_stream(COMPRESS& compress, size_t bufsize) {
+
+    std::string buff;
+
+    while (1) {
+        verbose_t::clock_type::time_point t = verbose_t::clock_type::now();
+
+        buff.resize(bufsize);
+        size_t i = ::fread((void*)buff.data(), 1, buff.size(), stdin);
+        buff.resize(i);
+
+        if (verbose)
+            verbose->add(verbose_t::READ, t, i);
+
+        if (i > 0) {
+            t = verbose_t::clock_type::now();
+            std::string out = compress.feed(buff);
+
+            if (verbose) {
+                ++verbose->chunks;
+                verbose->add(verbose_t::CODE, t, i);
+            }
+
+            t = verbose_t::clock_type::now();
+            ::fwrite(out.data(), 1, out.size(), stdout);
+
+            if (verbose)
+                verbose->add(verbose_t::WRITE, t, out.size());
+        }
+
+        if (i != bufsize)
+            break;
+    }
+}
+
+template <typename HASH>
+bool compress_stream(size_t searchlen, size_t blocksize, size_t window, const char* resume, size_t bufsize, size_t nthreads,
+                     size_t chains) {
+
+    lz77::basic_compress_t<HASH> compress(searchlen, blocksize, window);
+    compress.set_threads(nthreads);
+    compress.set_chains(chains);
+
+    if (resume && !resume_history(resume, compress))
+        return false;
+
+    compress_stream(compress, bufsize);
+    return true;
+}
+
+// 'yalz -t': decode every frame to check it, without writing anything.
+// Frames are found with lz77::skip_frame() and decoded in parallel,
+// each thread reusing one scratch buffer.
+
+struct frame_t {
+    const unsigned char* i;
+    const unsigned char* e;
+    size_t size;
+    size_t n;
+};
+
+void test_frames(const std::vector<frame_t>& frames, size_t first, size_t step,
+                 std::vector<unsigned char>& scratch, std::string& error) {
+
+    for (size_t k = first; k < frames.size(); k += step) {
+
+        const frame_t& f = frames[k];
+
+        try {
+
+            if (scratch.size() < f.size)
+                scratch.resize(f.size);
+
+            const unsigned char* i = f.i;
+            unsigned char* out = scratch.data();
+            size_t size = lz77::decompress_page(i, f.e, out, out + f.size);
+
+            if (size != f.size || i != f.e)
+                throw std::runtime_error("Size mismatch");
+
+        } catch (std::exception& ex) {
+            error = "frame " + std::to_string(f.n) + ": " + ex.what();
+            return;
+        }
+    }
+}
+
+int test(size_t nthreads) {
+
+    const size_t BUFSIZE = 64*1024*1024;
+
+    std::vector<std::vector<unsigned char> > scratch(nthreads);
+    std::vector<std::string> errors(nthreads);
+    std::vector<frame_t> frames;
+
+    std::string buff;
+    size_t nframe = 0;
+
+    while (1) {
+        size_t buff_size = buff.size();
+        buff.resize(buff_size + BUFSIZE);
+        size_t n = ::fread((void*)(buff.data() + buff_size), 1, BUFSIZE, stdin);
+        buff.resize(buff_size + n);
+
+        const unsigned char* b = (const unsigned char*)buff.data();
+        const unsigned char* e = b + buff.size();
+        const unsigned char* i = b;
+
+        frames.clear();
+
+        try {
+
+            while (i != e) {
+
+                if (lz77::append_frame(i, e)) {
+                    fprintf(stderr, "yalz: frame %zu: append-mode frames, use -a\n", nframe);
+                    return 1;
+                }
+
+                frame_t f;
+                f.i = i;
+                f.e = lz77::skip_frame(i, e, f.size);
+                f.n = nframe;
+
+                if (f.e == NULL)
+                    break;
+
+                frames.push_back(f);
+                i = f.e;
+                ++nframe;
+            }
+
+        } catch (std::exception& ex) {
+            fprintf(stderr, "yalz: frame %zu: %s\n", nframe, ex.what());
+            return 1;
+        }
+
+        std::vector<std::thread> threads;
+
+        for (size_t t = 0; t < nthreads; ++t)
+            threads.push_back(std::thread(test_frames, std::cref(frames), t, nthreads,
+                                          std::ref(scratch[t]), std::ref(errors[t])));
+
+        for (size_t t = 0; t < nthreads; ++t)
+            threads[t].join();
+
+        for (size_t t = 0; t < nthreads; ++t) {
+            if (errors[t].size() > 0) {
+                fprintf(stderr, "yalz: %s\n", errors[t].c_str());
+                return 1;
+            }
+        }
+
+        buff.erase(0, i - b);
+
+        if (n != BUFSIZE)
+            break;
+    }
+
+    if (buff.size() > 0) {
+        fprintf(stderr, "yalz: frame %zu: truncated\n", nframe);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Archives: 'yalz -A ARCHIVE FILES...', 'yalz -L ARCHIVE', 'yalz -X ARCHIVE NAME'.
+//
+// Files are grouped into solid blocks of about ARCHIVE_BLOCKSIZE bytes; each block
+// is one compressed frame, so files in a block share history. The index maps
+// each file to its block and its offset in the block, so one file is extracted
+// by decoding only its block.
+//
+// Layout:
+//   magic, blocks, index frame, index offset (8 bytes, little-endian), magic.
+//
+// Index (before compression), every number a VLQ as in the compressed format:
+//   number of blocks; for each block: archive offset, compressed size.
+//   number of files; for each file: name size, name, block, offset in block, size.
+//
+// Empty files are not stored in any block; their block and offset are 0.
+
+const char ARCHIVE_MAGIC[] = "YALZARC1";
+const size_t ARCHIVE_BLOCKSIZE = 4*1024*1024;
+
+struct archive_file_t {
+    std::string name;
+    size_t block;
+    size_t offset;
+    size_t size;
+};
+
+struct archive_block_t {
+    size_t offset;
+    size_t size;
+};
+
+bool read_file(const char* fname, std::string& out) {
+
+    FILE* f = ::fopen(fname, "rb");
+
+    if (!f)
+        return false;
+
+    out.clear();
+    std::string buff;
+
+    while (1) {
+        buff.resize(1024*1024);
+        size_t i = ::fread((void*)buff.data(), 1, buff.size(), f);
+        out.append(buff, 0, i);
+
+        if (i != buff.size())
+            break;
+    }
+
+    ::fclose(f);
+    return true;
+}
+
+void write_u64(uint64_t n, std::string& out) {
+
+    for (int k = 0; k < 8; ++k) {
+        out += (char)(n & 0xFF);
+        n = n >> 8;
+    }
+}
+
+uint64_t read_u64(const unsigned char* i) {
+
+    uint64_t n = 0;
+
+    for (int k = 7; k >= 0; --k)
+        n = (n << 8) | i[k];
+
+    return n;
+}
+
+void compress_block(const std::string* in, std::string* out) {
+
+    lz77::compress_t compress;
+    *out = compress.feed(*in);
+}
+
+// 'yalz -A -O': sketch the files on several threads and put similar files next to each other.
+
+void sketch_files(const std::vector<const char*>* fnames, std::vector<lz77::sketch_t>* sketches,
+                  size_t first, size_t step) {
+
+    std::string data;
+
+    for (size_t n = first; n < fnames->size(); n += step) {
+
+        if (!read_file((*fnames)[n], data))
+            data.clear();
+
+        const unsigned char* i = (const unsigned char*)data.data();
+        lz77::make_sketch(i, i + data.size(), (*sketches)[n]);
+    }
+}
+
+void order_files(std::vector<const char*>& fnames, size_t nthreads) {
+
+    std::vector<lz77::sketch_t> sketches(fnames.size());
+    std::vector<std::thread> threads;
+
+    for (size_t t = 0; t < nthreads; ++t)
+        threads.push_back(std::thread(sketch_files, &fnames, &sketches, t, nthreads));
+
+    for (size_t t = 0; t < nthreads; ++t)
+        threads[t].join();
+
+    std::vector<size_t> order = lz77::similarity_order(sketches);
+    std::vector<const char*> ordered;
+
+    for (size_t n = 0; n < order.size(); ++n)
+        ordered.push_back(fnames[order[n]]);
+
+    fnames.swap(ordered);
+}
+
+int archive_create(const char* aname, const std::vector<const char*>& fnames, size_t nthreads) {
+
+    FILE* out = ::fopen(aname, "wb");
+
+    if (!out) {
+        fprintf(stderr, "yalz: could not open %s\n", aname);
+        return 1;
+    }
+
+    std::vector<archive_file_t> files;
+    std::vector<archive_block_t> blocks;
+
+    std::string pos(ARCHIVE_MAGIC, 8);
+    ::fwrite(pos.data(), 1, pos.size(), out);
+    size_t offset = pos.size();
+
+    // Blocks are filled in order and compressed 'nthreads' at a time.
+
+    std::vector<std::string> pending(nthreads);
+    std::vector<std::string> packed(nthreads);
+    size_t npending = 0;
+    std::string data;
+
+    for (size_t n = 0; n <= fnames.size(); ++n) {
+
+        bool last = (n == fnames.size());
+
+        if (!last) {
+
+            if (!read_file(fnames[n], data)) {
+                fprintf(stderr, "yalz: could not read %s\n", fnames[n]);
+                return 1;
+            }
+
+            std::string& block = pending[npending];
+
+            if (block.size() > 0 && block.size() + data.size() > ARCHIVE_BLOCKSIZE) {
+                ++npending;
+            }
+        }
+
+        if (npending == nthreads || last) {
+
+            if (last && pending[npending].size() > 0)
+                ++npending;
+
+            std::vector<std::thread> threads;
+
+            for (size_t t = 0; t < npending; ++t)
+                threads.push_back(std::thread(compress_block, &pending[t], &packed[t]));
+
+            for (size_t t = 0; t < npending; ++t) {
+                threads[t].join();
+
+                archive_block_t b;
+                b.offset = offset;
+                b.size = packed[t].size();
+                blocks.push_back(b);
+
+                ::fwrite(packed[t].data(), 1, packed[t].size(), out);
+                offset += b.size;
+
+                pending[t].clear();
+            }
+
+            npending = 0;
+        }
+
+        if (last)
+            break;
+
+        archive_file_t f;
+        f.name = fnames[n];
+        f.block = 0;
+        f.offset = 0;
+        f.size = data.size();
+
+        if (f.size > 0) {
+            f.block = blocks.size() + npending;
+            f.offset = pending[npending].size();
+        }
+
+        files.push_back(f);
+
+        pending[npending] += data;
+    }
+
+    std::string index;
+
+    lz77::push_vlq_uint(blocks.size(), index);
+
+    for (size_t n = 0; n < blocks.size(); ++n) {
+        lz77::push_vlq_uint(blocks[n].offset, index);
+        lz77::push_vlq_uint(blocks[n].size, index);
+    }
+
+    lz77::push_vlq_uint(files.size(), index);
+
+    for (size_t n = 0; n < files.size(); ++n) {
+        lz77::push_vlq_uint(files[n].name.size(), index);
+        index += files[n].name;
+        lz77::push_vlq_uint(files[n].block, index);
+        lz77::push_vlq_uint(files[n].offset, index);
+        lz77::push_vlq_uint(files[n].size, index);
+    }
+
+    lz77::compress_t compress;
+    std::string tail = compress.feed(index);
+    write_u64(offset, tail);
+    tail.append(ARCHIVE_MAGIC, 8);
+
+    ::fwrite(tail.data(), 1, tail.size(), out);
+
+    if (::fclose(out) != 0) {
+        fprintf(stderr, "yalz: could not write %s\n", aname);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Decode one frame from [i, e); throws if it isn't a whole frame.
+
+void decode_frame(const unsigned char* i, const unsigned char* e, std::string& out) {
+
+    lz77::decompress_t decompress;
+    std::string extra;
+
+    if (!decompress.feed(i, e, extra) || extra.size() > 0)
+        throw std::runtime_error("Malformed archive");
+
+    out.swap(decompress.result());
+}
+
+void archive_read_index(FILE* f, std::vector<archive_block_t>& blocks, std::vector<archive_file_t>& files) {
+
+    if (::fseeko(f, 0, SEEK_END) != 0)
+        throw std::runtime_error("Archive is not seekable");
+
+    size_t fsize = ::ftello(f);
+
+    if (fsize < 24)
+        throw std::runtime_error("Not an archive");
+
+    unsigned char trailer[16];
+
+    if (::fseeko(f, fsize - 16, SEEK_SET) != 0 || ::fread(trailer, 1, 16, f) != 16 ||
+        ::memcmp(trailer + 8, ARCHIVE_MAGIC, 8) != 0)
+        throw std::runtime_error("Not an archive");
+
+    size_t offset = read_u64(trailer);
+
+    if (offset > fsize - 16)
+        throw std::runtime_error("Malformed archive");
+
+    std::string packed;
+    packed.resize(fsize - 16 - offset);
+
+    if (::fseeko(f, offset, SEEK_SET) != 0 || ::fread((void*)packed.data(), 1, packed.size(), f) != packed.size())
+        throw std::runtime_error("Malformed archive");
+
+    const unsigned char* pi = (const unsigned char*)packed.data();
+
+    std::string index;
+    decode_frame(pi, pi + packed.size(), index);
+
+    const unsigned char* i = (const unsigned char*)index.data();
+    const unsigned char* e = i + index.size();
+
+    size_t n;
+
+    if (!lz77::read_vlq_uint(i, e, n))
+        throw std::runtime_error("Malformed archive");
+
+    blocks.resize(n);
+
+    for (size_t k = 0; k < n; ++k) {
+        if (!lz77::read_vlq_uint(i, e, blocks[k].offset) || !lz77::read_vlq_uint(i, e, blocks[k].size))
+            throw std::runtime_error("Malformed archive");
+    }
+
+    if (!lz77::read_vlq_uint(i, e, n))
+        throw std::runtime_error("Malformed archive");
+
+    files.resize(n);
+
+    for (size_t k = 0; k < n; ++k) {
+
+        archive_file_t& af = files[k];
+        size_t len;
+
+        if (!lz77::read_vlq_uint(i, e, len) || len > (size_t)(e - i))
+            throw std::runtime_error("Malformed archive");
+
+        af.name.assign((const char*)i, len);
+        i += len;
+
+        if (!lz77::read_vlq_uint(i, e, af.block) || !lz77::read_vlq_uint(i, e, af.offset) ||
+            !lz77::read_vlq_uint(i, e, af.size) || (af.size > 0 && af.block >= blocks.size()))
+            throw std::runtime_error("Malformed archive");
+    }
+}
+
+int archive_list(const char* aname) {
+
+    FILE* f = ::fopen(aname, "rb");
+
+    if (!f) {
+        fprintf(stderr, "yalz: could not open %s\n", aname);
+        return 1;
+    }
+
+    std::vector<archive_block_t> blocks;
+    std::vector<archive_file_t> files;
+
+    try {
+        archive_read_index(f, blocks, files);
+
+    } catch (std::exception& ex) {
+        ::fclose(f);
+        fprintf(stderr, "yalz: %s: %s\n", aname, ex.what());
+        return 1;
+    }
+
+    ::fclose(f);
+
+    for (size_t n = 0; n < files.size(); ++n)
+        printf("%12zu  %s\n", files[n].size, files[n].name.c_str());
+
+    return 0;
+}
+
+int archive_extract(const char* aname, const std::string& name) {
+
+    FILE* f = ::fopen(aname, "rb");
+
+    if (!f) {
+        fprintf(stderr, "yalz: could not open %s\n", aname);
+        return 1;
+    }
+
+    std::vector<archive_block_t> blocks;
+    std::vector<archive_file_t> files;
+
+    try {
+        archive_read_index(f, blocks, files);
+
+        for (size_t n = 0; n < files.size(); ++n) {
+
+            const archive_file_t& af = files[n];
+
+            if (af.name != name)
+                continue;
+
+            if (af.size == 0) {
+                ::fclose(f);
+                return 0;
+            }
+
+            const archive_block_t& ab = blocks[af.block];
+
+            std::string packed;
+            packed.resize(ab.size);
+
+            if (::fseeko(f, ab.offset, SEEK_SET) != 0 ||
+                ::fread((void*)packed.data(), 1, packed.size(), f) != packed.size())
+                throw std::runtime_error("Malformed archive");
+
+            const unsigned char* pi = (const unsigned char*)packed.data();
+
+            std::string block;
+            decode_frame(pi, pi + packed.size(), block);
+
+            if (af.offset > block.size() || af.size > block.size() - af.offset)
+                throw std::runtime_error("Malformed archive");
+
+            ::fclose(f);
+
+            ::fwrite(block.data() + af.offset, 1, af.size, stdout);
+            return 0;
+        }
+
+    } catch (std::exception& ex) {
+        ::fclose(f);
+        fprintf(stderr, "yalz: %s: %s\n", aname, ex.what());
+        return 1;
+    }
+
+    ::fclose(f);
+
+    fprintf(stderr, "yalz: %s is not in %s\n", name.c_str(), aname);
+    return 1;
+}
+
+int run(int argc, char** argv) {
 
     bool compress = false;
     bool decompress = false;
     bool fastmode = false;
+    bool fastestmode = false;
     bool smallmode = false;
+    bool appendmode = false;
+    bool sparse = false;
+    const char* resume = NULL;
+    const char* mapped = NULL;
+    bool testmode = false;
+    bool ordermode = false;
+    bool parallelmode = false;
+    bool verbosemode = false;
+    std::string hash = "fnv";
+    size_t nthreads = std::thread::hardware_concurrency();
+    const char* pattern = NULL;
+    size_t chains = 0;
 
     for (int i = 1; i < argc; ++i) {
         std::string arg(argv[i]);
 
-        if (arg == "-c")
+        if (arg == "--grep" && i + 1 < argc) {
+            pattern = argv[++i];
+        } else if (arg == "-e" && i + 1 < argc) {
+            return embed(argv[++i]);
+        } else if (arg == "-r" && i + 1 < argc) {
+            appendmode = true;
+            resume = argv[++i];
+        } else if (arg == "-m" && i + 1 < argc) {
+            mapped = argv[++i];
+        } else if (arg == "-H" && i + 1 < argc) {
+            hash = argv[++i];
+        } else if (arg == "-j" && i + 1 < argc) {
+            nthreads = ::atol(argv[++i]);
+        } else if (arg == "--chains" && i + 1 < argc) {
+            chains = ::atol(argv[++i]);
+        } else if (arg == "-a")
+            appendmode = true;
+        else if (arg == "-t")
+            testmode = true;
+        else if (arg == "-O")
+            ordermode = true;
+        else if (arg == "-p")
+            parallelmode = true;
+        else if (arg == "-v")
+            verbosemode = true;
+        else if (arg == "-S")
+            sparse = true;
+        else if (arg == "-c")
             compress = true;
         else if (arg == "-d")
             decompress = true;
+        else if (arg == "-0")
+            fastestmode = true;
         else if (arg == "-1")
             fastmode = true;
         else if (arg == "-2")
             smallmode = true;
     }
 
+    if (nthreads == 0)
+        nthreads = 1;
+
+    if (pattern)
+        return grep(pattern, appendmode);
+
+    for (int i = 1; i + 1 < argc; ++i) {
+        std::string arg(argv[i]);
+
+        if (arg == "-A") {
+            std::vector<const char*> fnames(argv + i + 2, argv + argc);
+
+            if (ordermode)
+                order_files(fnames, nthreads);
+
+            return archive_create(argv[i + 1], fnames, nthreads);
+
+        } else if (arg == "-L") {
+            return archive_list(argv[i + 1]);
+
+        } else if (arg == "-X" && i + 2 < argc) {
+            return archive_extract(argv[i + 1], argv[i + 2]);
+        }
+    }
+
+    if (testmode && !appendmode)
+        return test(nthreads);
+
+    // Append-mode frames depend on each other, so they are tested in order.
+    if (testmode)
+        decompress = true;
+
     const size_t BUFSIZE = (smallmode || decompress ? 100*1024 : 10*1024*1024);
 
-    if (compress) {
+    if (verbosemode && (compress || decompress))
+        verbose = new verbose_t(!compress);
 
-        std::string buff;
+    if (compress && fastestmode) {
+
+        if (appendmode) {
+            fprintf(stderr, "'-0' can't make append-mode frames.\n");
+            return 1;
+        }
+
+        lz77::fast_compress_t<> compress;
+        compress_stream(compress, BUFSIZE);
+
+    } else if (compress) {
 
         size_t searchlen = (fastmode ? 1 : lz77::DEFAULT_SEARCHLEN);
         size_t blocksize = (smallmode ? 4096 : lz77::DEFAULT_BLOCKSIZE);
         
-        lz77::compress_t compress(searchlen, blocksize);
-
-        while (1) {
-            buff.resize(BUFSIZE);
-            size_t i = ::fread((void*)buff.data(), 1, buff.size(), stdin);
-            buff.resize(i);
+        size_t window = (appendmode ? lz77::DEFAULT_WINDOW : 0);
+        size_t parallel = (parallelmode ? nthreads : 0);
+        bool ok;
 
-            if (i > 0) {
-                std::string out = compress.feed(buff);
-                ::fwrite(out.data(), 1, out.size(), stdout);
-            }
+        if (hash == "mul")
+            ok = compress_stream<lz77::multiply_hash_t>(searchlen, blocksize, window, resume, BUFSIZE, parallel, chains);
+        else if (hash == "crc")
+            ok = compress_stream<lz77::crc32c_hash_t>(searchlen, blocksize, window, resume, BUFSIZE, parallel, chains);
+        else
+            ok = compress_stream<lz77::fnv_hash_t>(searchlen, blocksize, window, resume, BUFSIZE, parallel, chains);
 
-            if (i != BUFSIZE)
-                break;
-        }
+        if (!ok)
+            return 1;
     
     } else if (decompress) {
 
@@ -55,28 +1304,68 @@ int main(int argc, char** argv) {
         buff.resize(BUFSIZE);
         size_t buff_size = 0;
 
-        lz77::decompress_t decompress;
+        lz77::decompress_t decompress(0, (appendmode ? lz77::DEFAULT_WINDOW : 0));
         std::string extra;
+        bool first = true;
+
+        sparse_writer_t* sparse_out = (sparse ? new sparse_writer_t : NULL);
+        mmap_writer_t* mmap_out = (mapped ? new mmap_writer_t(mapped) : NULL);
+
+        if (mmap_out) {
+            decompress.alloc = mmap_writer_t::alloc;
+            decompress.alloc_ctx = mmap_out;
+        }
 
         while (1) {
+            verbose_t::clock_type::time_point t = verbose_t::clock_type::now();
+
             buff_size = ::fread((void*)buff.data(), 1, buff.size(), stdin);
+
+            if (verbose)
+                verbose->add(verbose_t::READ, t, buff_size);
             
             if (buff_size == 0)
                 break;
 
+            // Append-mode frames are marked, so they are decoded as such without '-a'.
+            if (first && lz77::append_frame((const unsigned char*)buff.data(), (const unsigned char*)buff.data() + buff_size))
+                decompress.window = lz77::DEFAULT_WINDOW;
+
+            first = false;
+
             std::string* what = &buff;
             size_t what_size = buff_size;
             
             while (what_size > 0) {
 
                 const unsigned char* whatd = (const unsigned char*)what->data();
+
+                t = verbose_t::clock_type::now();
                 bool done = decompress.feed(whatd, whatd + what_size, extra);
 
+                if (verbose) {
+                    verbose->chunks += (done ? 1 : 0);
+                    verbose->add(verbose_t::CODE, t, (done ? decompress.oute - decompress.outb : 0));
+                }
+
                 if (!done)
                     break;
 
                 const std::string& result = decompress.result();
-                ::fwrite(result.data(), 1, result.size(), stdout);
+
+                t = verbose_t::clock_type::now();
+
+                if (testmode)
+                    ;
+                else if (mmap_out)
+                    mmap_out->done();
+                else if (sparse_out)
+                    sparse_out->write((const unsigned char*)result.data(), result.size());
+                else
+                    ::fwrite(result.data(), 1, result.size(), stdout);
+
+                if (verbose)
+                    verbose->add(verbose_t::WRITE, t, decompress.oute - decompress.outb);
 
                 what = &extra;
                 what_size = extra.size();
@@ -86,13 +1375,60 @@ int main(int argc, char** argv) {
                 break;
         }
 
+        if (sparse_out) {
+            sparse_out->finish();
+            delete sparse_out;
+        }
+
+        delete mmap_out;
+
     } else {
-        fprintf(stderr, "Usage: %s [-1|-2] {-c|-d}, where -c is compression and -d is decompression.\n"
+        fprintf(stderr, "Usage: %s [-0|-1|-2] [-p [-j THREADS]] [-H HASH] [--chains DEPTH] [-a|-r FILE] [-S|-m FILE] [-v] {-c|-d}, where -c is compression and -d is decompression.\n"
                 "  Input is stdin and and output is stdout.\n"
+                "  Add '-0' when compressing to use the fastest compressor, lz77::fast_compress_t.\n"
                 "  Add '-1' when compressing to enable fast and bad compression.\n"
-                "  Add '-2' when compressing to enable a compression mode for small files.\n", argv[0]);
+                "  Add '-2' when compressing to enable a compression mode for small files.\n"
+                "  Add '-p' when compressing to find matches on THREADS threads; smaller, more total work.\n"
+                "  Add '-H fnv|mul|crc' when compressing to pick the prefix hash function.\n"
+                "  Add '--chains DEPTH' when compressing to find matches with hash chains of up to DEPTH\n"
+                "  positions over the last megabyte, instead of the buckets; less memory, usually slower.\n"
+                "  Add '-a' to make append-mode frames that reference previous frames. '-d' and '-t'\n"
+                "  recognize them; '-t' and files made before they were marked still need '-a'.\n"
+                "  Add '-r FILE' when compressing to continue the history of an existing\n"
+                "  append-mode FILE; e.g. 'yalz -c -r log.lz < new >> log.lz'.\n"
+                "  Add '-S' when decompressing to leave holes for blocks of zeros in the output file.\n"
+                "  Add '-m FILE' when decompressing to decode into a memory-mapped FILE instead of stdout.\n"
+                "  Add '-v' to print the time and bytes of reading, (de)compressing and writing to stderr.\n"
+                "       %s -t [-j THREADS]\n"
+                "  Check that compressed stdin decodes properly, using THREADS threads.\n"
+                "       %s [-j THREADS] [-O] -A ARCHIVE FILES...\n"
+                "       %s -L ARCHIVE\n"
+                "       %s -X ARCHIVE NAME\n"
+                "  Make an archive of FILES in solid blocks, list it, or extract file NAME to stdout.\n"
+                "  Add '-O' to put similar files next to each other in the archive.\n"
+                "       %s [-a] --grep PATTERN\n"
+                "  Print the lines of compressed stdin that contain the fixed string PATTERN.\n"
+                "       %s -e NAME\n"
+                "  Write a C++ header that embeds stdin as a lazily decompressed lz77::asset_t.\n", argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 1;
     }
 
+    if (verbose) {
+        verbose->report();
+        delete verbose;
+    }
+
     return 0;
 }
+
+int main(int argc, char** argv) {
+
+    try {
+        return run(argc, argv);
+
+    } catch (std::exception& ex) {
+        ::fflush(stdout);
+        fprintf(stderr, "yalz: %s\n", ex.what());
+        return 1;
+    }
+}